@@ -2,11 +2,16 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <glib.h>
+#include <linux/dma-buf.h>
+#include <linux/udmabuf.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-
-#define MAX_VIDEO_BUFFERS 20
+#include <sys/utsname.h>
+#include <unistd.h>
 
 static const char *pixel_format_names[MP_PIXEL_FMT_MAX] = {
     "unsupported",
@@ -14,6 +19,22 @@ static const char *pixel_format_names[MP_PIXEL_FMT_MAX] = {
     "GBRG8",
     "GRBG8",
     "RGGB8",
+    "BGGR10",
+    "GBRG10",
+    "GRBG10",
+    "RGGB10",
+    "BGGR12",
+    "GBRG12",
+    "GRBG12",
+    "RGGB12",
+    "BGGR10P",
+    "GBRG10P",
+    "GRBG10P",
+    "RGGB10P",
+    "BGGR12P",
+    "GBRG12P",
+    "GRBG12P",
+    "RGGB12P",
 };
 
 const char *mp_pixel_format_to_str(uint32_t pixel_format)
@@ -38,6 +59,22 @@ static const uint32_t pixel_format_v4l_pixel_formats[MP_PIXEL_FMT_MAX] = {
     V4L2_PIX_FMT_SGBRG8,
     V4L2_PIX_FMT_SGRBG8,
     V4L2_PIX_FMT_SRGGB8,
+    V4L2_PIX_FMT_SBGGR10,
+    V4L2_PIX_FMT_SGBRG10,
+    V4L2_PIX_FMT_SGRBG10,
+    V4L2_PIX_FMT_SRGGB10,
+    V4L2_PIX_FMT_SBGGR12,
+    V4L2_PIX_FMT_SGBRG12,
+    V4L2_PIX_FMT_SGRBG12,
+    V4L2_PIX_FMT_SRGGB12,
+    V4L2_PIX_FMT_SBGGR10P,
+    V4L2_PIX_FMT_SGBRG10P,
+    V4L2_PIX_FMT_SGRBG10P,
+    V4L2_PIX_FMT_SRGGB10P,
+    V4L2_PIX_FMT_SBGGR12P,
+    V4L2_PIX_FMT_SGBRG12P,
+    V4L2_PIX_FMT_SGRBG12P,
+    V4L2_PIX_FMT_SRGGB12P,
 };
 
 uint32_t mp_pixel_format_to_v4l_pixel_format(MPPixelFormat pixel_format)
@@ -62,6 +99,22 @@ static const uint32_t pixel_format_v4l_bus_codes[MP_PIXEL_FMT_MAX] = {
     MEDIA_BUS_FMT_SGBRG8_1X8,
     MEDIA_BUS_FMT_SGRBG8_1X8,
     MEDIA_BUS_FMT_SRGGB8_1X8,
+    MEDIA_BUS_FMT_SBGGR10_1X10,
+    MEDIA_BUS_FMT_SGBRG10_1X10,
+    MEDIA_BUS_FMT_SGRBG10_1X10,
+    MEDIA_BUS_FMT_SRGGB10_1X10,
+    MEDIA_BUS_FMT_SBGGR12_1X12,
+    MEDIA_BUS_FMT_SGBRG12_1X12,
+    MEDIA_BUS_FMT_SGRBG12_1X12,
+    MEDIA_BUS_FMT_SRGGB12_1X12,
+    MEDIA_BUS_FMT_SBGGR10_1X10,
+    MEDIA_BUS_FMT_SGBRG10_1X10,
+    MEDIA_BUS_FMT_SGRBG10_1X10,
+    MEDIA_BUS_FMT_SRGGB10_1X10,
+    MEDIA_BUS_FMT_SBGGR12_1X12,
+    MEDIA_BUS_FMT_SGBRG12_1X12,
+    MEDIA_BUS_FMT_SGRBG12_1X12,
+    MEDIA_BUS_FMT_SRGGB12_1X12,
 };
 
 uint32_t mp_pixel_format_to_v4l_bus_code(MPPixelFormat pixel_format)
@@ -80,18 +133,94 @@ MPPixelFormat mp_pixel_format_from_v4l_bus_code(uint32_t v4l_bus_code)
     return MP_PIXEL_FMT_UNSUPPORTED;
 }
 
-uint32_t mp_pixel_format_bytes_per_pixel(MPPixelFormat pixel_format)
+uint32_t mp_pixel_format_bits_per_pixel(MPPixelFormat pixel_format)
 {
     g_return_val_if_fail(pixel_format < MP_PIXEL_FMT_MAX, 0);
     switch (pixel_format) {
         case MP_PIXEL_FMT_BGGR8:
         case MP_PIXEL_FMT_GBRG8:
         case MP_PIXEL_FMT_GRBG8:
-        case MP_PIXEL_FMT_RGGB8: return 1;
+        case MP_PIXEL_FMT_RGGB8: return 8;
+        case MP_PIXEL_FMT_BGGR10:
+        case MP_PIXEL_FMT_GBRG10:
+        case MP_PIXEL_FMT_GRBG10:
+        case MP_PIXEL_FMT_RGGB10:
+        case MP_PIXEL_FMT_BGGR10P:
+        case MP_PIXEL_FMT_GBRG10P:
+        case MP_PIXEL_FMT_GRBG10P:
+        case MP_PIXEL_FMT_RGGB10P: return 10;
+        case MP_PIXEL_FMT_BGGR12:
+        case MP_PIXEL_FMT_GBRG12:
+        case MP_PIXEL_FMT_GRBG12:
+        case MP_PIXEL_FMT_RGGB12:
+        case MP_PIXEL_FMT_BGGR12P:
+        case MP_PIXEL_FMT_GBRG12P:
+        case MP_PIXEL_FMT_GRBG12P:
+        case MP_PIXEL_FMT_RGGB12P: return 12;
         default: return 0;
     }
 }
 
+uint32_t mp_pixel_format_width_to_bytes(MPPixelFormat pixel_format, uint32_t width)
+{
+    g_return_val_if_fail(pixel_format < MP_PIXEL_FMT_MAX, 0);
+    switch (pixel_format) {
+        case MP_PIXEL_FMT_BGGR8:
+        case MP_PIXEL_FMT_GBRG8:
+        case MP_PIXEL_FMT_GRBG8:
+        case MP_PIXEL_FMT_RGGB8: return width;
+        case MP_PIXEL_FMT_BGGR10:
+        case MP_PIXEL_FMT_GBRG10:
+        case MP_PIXEL_FMT_GRBG10:
+        case MP_PIXEL_FMT_RGGB10:
+        case MP_PIXEL_FMT_BGGR12:
+        case MP_PIXEL_FMT_GBRG12:
+        case MP_PIXEL_FMT_GRBG12:
+        case MP_PIXEL_FMT_RGGB12: return width * 2;
+        case MP_PIXEL_FMT_BGGR10P:
+        case MP_PIXEL_FMT_GBRG10P:
+        case MP_PIXEL_FMT_GRBG10P:
+        case MP_PIXEL_FMT_RGGB10P: return width / 4 * 5;
+        case MP_PIXEL_FMT_BGGR12P:
+        case MP_PIXEL_FMT_GBRG12P:
+        case MP_PIXEL_FMT_GRBG12P:
+        case MP_PIXEL_FMT_RGGB12P: return width / 2 * 3;
+        default: return 0;
+    }
+}
+
+void mp_pixel_format_unpack_row(MPPixelFormat pixel_format, const uint8_t *src, uint32_t width, uint16_t *dst)
+{
+    switch (pixel_format) {
+        case MP_PIXEL_FMT_BGGR10P:
+        case MP_PIXEL_FMT_GBRG10P:
+        case MP_PIXEL_FMT_GRBG10P:
+        case MP_PIXEL_FMT_RGGB10P:
+            for (uint32_t i = 0; i < width / 4; ++i) {
+                const uint8_t *group = src + i * 5;
+                for (uint32_t j = 0; j < 4; ++j) {
+                    dst[i * 4 + j] = group[j] << 2 | ((group[4] >> (j * 2)) & 0x3);
+                }
+            }
+            break;
+        case MP_PIXEL_FMT_BGGR12P:
+        case MP_PIXEL_FMT_GBRG12P:
+        case MP_PIXEL_FMT_GRBG12P:
+        case MP_PIXEL_FMT_RGGB12P:
+            for (uint32_t i = 0; i < width / 2; ++i) {
+                const uint8_t *group = src + i * 3;
+                dst[i * 2] = group[0] << 4 | (group[2] & 0xf);
+                dst[i * 2 + 1] = group[1] << 4 | group[2] >> 4;
+            }
+            break;
+        default:
+            for (uint32_t i = 0; i < width; ++i) {
+                dst[i] = src[i * 2] | src[i * 2 + 1] << 8;
+            }
+            break;
+    }
+}
+
 bool mp_camera_mode_is_equivalent(const MPCameraMode *m1, const MPCameraMode *m2)
 {
     return m1->pixel_format == m2->pixel_format
@@ -104,6 +233,8 @@ bool mp_camera_mode_is_equivalent(const MPCameraMode *m1, const MPCameraMode *m2
 struct video_buffer {
     uint32_t length;
     uint8_t *data;
+    // The DMABUF imported by the driver, -1 for the other kinds of memory
+    int fd;
 };
 
 struct _MPCamera {
@@ -113,8 +244,21 @@ struct _MPCamera {
     bool has_set_mode;
     MPCameraMode current_mode;
 
-    struct video_buffer buffers[MAX_VIDEO_BUFFERS];
+    // The last mode the sensor was asked for and the one it went with, the
+    // sensor keeps it while the other camera is in use
+    bool has_subdev_mode;
+    MPCameraMode subdev_request;
+    MPCameraMode subdev_mode;
+
+    // Put on the captured images
+    int32_t fixed_exposure;
+    int32_t fixed_gain;
+
+    MPCameraMemory memory;
+    struct video_buffer buffers[MP_CAMERA_MAX_BUFFERS];
     uint32_t num_buffers;
+    // Buffers taken from the driver that haven't been queued again yet
+    uint32_t num_dequeued;
 };
 
 MPCamera *mp_camera_new(int video_fd, int subdev_fd)
@@ -125,7 +269,12 @@ MPCamera *mp_camera_new(int video_fd, int subdev_fd)
     camera->video_fd = video_fd;
     camera->subdev_fd = subdev_fd;
     camera->has_set_mode = false;
+    camera->has_subdev_mode = false;
+    camera->fixed_exposure = 0;
+    camera->fixed_gain = 0;
+    camera->memory = MP_CAMERA_MEMORY_MMAP;
     camera->num_buffers = 0;
+    camera->num_dequeued = 0;
     return camera;
 }
 
@@ -156,7 +305,10 @@ int mp_camera_get_subdev_fd(MPCamera *camera)
 
 static void errno_printerr(const char *s)
 {
-    g_printerr("MPCamera: %s error %d, %s\n", s, errno, strerror(errno));
+    // Keep errno for the caller
+    int error = errno;
+    g_printerr("MPCamera: %s error %d, %s\n", s, error, strerror(error));
+    errno = error;
 }
 
 static int xioctl(int fd, int request, void *arg)
@@ -193,53 +345,84 @@ const MPCameraMode *mp_camera_get_mode(const MPCamera *camera)
     return &camera->current_mode;
 }
 
-bool mp_camera_set_mode(MPCamera *camera, MPCameraMode *mode)
+static bool set_subdev_mode(MPCamera *camera, MPCameraMode *mode)
 {
-    // Set the mode in the subdev the camera is one
-    if (mp_camera_is_subdev(camera))
+    // Setting the same mode again can take a while on some sensors
+    if (camera->has_subdev_mode
+        && (mp_camera_mode_is_equivalent(mode, &camera->subdev_request)
+            || mp_camera_mode_is_equivalent(mode, &camera->subdev_mode))) {
+        *mode = camera->subdev_mode;
+        return true;
+    }
+
+    camera->has_subdev_mode = false;
+    camera->subdev_request = *mode;
+
+    struct v4l2_subdev_frame_interval interval = {};
+    interval.pad = 0;
+    interval.interval = mode->frame_interval;
+    if (xioctl(camera->subdev_fd, VIDIOC_SUBDEV_S_FRAME_INTERVAL, &interval) == -1) {
+        errno_printerr("VIDIOC_SUBDEV_S_FRAME_INTERVAL");
+        return false;
+    }
+
+    bool did_set_frame_rate =
+        interval.interval.numerator == mode->frame_interval.numerator
+        && interval.interval.denominator == mode->frame_interval.denominator;
+
+    struct v4l2_subdev_format fmt = {};
+    fmt.pad = 0;
+    fmt.which = V4L2_SUBDEV_FORMAT_ACTIVE;
+    fmt.format.width = mode->width;
+    fmt.format.height = mode->height;
+    fmt.format.code = mp_pixel_format_to_v4l_bus_code(mode->pixel_format);
+    fmt.format.field = V4L2_FIELD_ANY;
+    if (xioctl(camera->subdev_fd, VIDIOC_SUBDEV_S_FMT, &fmt) == -1) {
+        errno_printerr("VIDIOC_SUBDEV_S_FMT");
+        return false;
+    }
+
+    // Some drivers like ov5640 don't allow you to set the frame format with
+    // too high a frame-rate, but that means the frame-rate won't be set
+    // after the format change. So we need to try again here if we didn't
+    // succeed before. Ideally we'd be able to set both at once.
+    if (!did_set_frame_rate)
     {
-        struct v4l2_subdev_frame_interval interval = {};
-        interval.pad = 0;
         interval.interval = mode->frame_interval;
         if (xioctl(camera->subdev_fd, VIDIOC_SUBDEV_S_FRAME_INTERVAL, &interval) == -1) {
             errno_printerr("VIDIOC_SUBDEV_S_FRAME_INTERVAL");
             return false;
         }
+    }
 
-        bool did_set_frame_rate =
-            interval.interval.numerator == mode->frame_interval.numerator
-            && interval.interval.denominator == mode->frame_interval.denominator;
+    // Update the mode, packed and unpacked formats share a bus code so
+    // keep the one asked for if it still matches
+    if (fmt.format.code != mp_pixel_format_to_v4l_bus_code(mode->pixel_format)) {
+        mode->pixel_format = mp_pixel_format_from_v4l_bus_code(fmt.format.code);
+    }
+    mode->frame_interval = interval.interval;
+    mode->width = fmt.format.width;
+    mode->height = fmt.format.height;
 
-        struct v4l2_subdev_format fmt = {};
-        fmt.pad = 0;
-        fmt.which = V4L2_SUBDEV_FORMAT_ACTIVE;
-        fmt.format.width = mode->width;
-        fmt.format.height = mode->height;
-        fmt.format.code = mp_pixel_format_to_v4l_bus_code(mode->pixel_format);
-        fmt.format.field = V4L2_FIELD_ANY;
-        if (xioctl(camera->subdev_fd, VIDIOC_SUBDEV_S_FMT, &fmt) == -1) {
-            errno_printerr("VIDIOC_SUBDEV_S_FMT");
-            return false;
-        }
+    camera->has_subdev_mode = true;
+    camera->subdev_mode = *mode;
 
-        // Some drivers like ov5640 don't allow you to set the frame format with
-        // too high a frame-rate, but that means the frame-rate won't be set
-        // after the format change. So we need to try again here if we didn't
-        // succeed before. Ideally we'd be able to set both at once.
-        if (!did_set_frame_rate)
-        {
-            interval.interval = mode->frame_interval;
-            if (xioctl(camera->subdev_fd, VIDIOC_SUBDEV_S_FRAME_INTERVAL, &interval) == -1) {
-                errno_printerr("VIDIOC_SUBDEV_S_FRAME_INTERVAL");
-                return false;
-            }
-        }
+    return true;
+}
 
-        // Update the mode
-        mode->pixel_format = mp_pixel_format_from_v4l_bus_code(fmt.format.code);
-        mode->frame_interval = interval.interval;
-        mode->width = fmt.format.width;
-        mode->height = fmt.format.height;
+bool mp_camera_prepare_mode(MPCamera *camera, MPCameraMode *mode)
+{
+    if (!mp_camera_is_subdev(camera)) {
+        return true;
+    }
+    return set_subdev_mode(camera, mode);
+}
+
+bool mp_camera_set_mode(MPCamera *camera, MPCameraMode *mode)
+{
+    // Set the mode in the subdev the camera is one
+    if (mp_camera_is_subdev(camera) && !set_subdev_mode(camera, mode)) {
+        return false;
     }
 
     // Set the mode for the video device
@@ -267,19 +450,103 @@ bool mp_camera_set_mode(MPCamera *camera, MPCameraMode *mode)
     return true;
 }
 
-bool mp_camera_start_capture(MPCamera *camera)
+static const enum v4l2_memory v4l2_memory[] = {
+    [MP_CAMERA_MEMORY_MMAP] = V4L2_MEMORY_MMAP,
+    [MP_CAMERA_MEMORY_USERPTR] = V4L2_MEMORY_USERPTR,
+    [MP_CAMERA_MEMORY_DMABUF] = V4L2_MEMORY_DMABUF,
+};
+
+static bool queue_buffer(MPCamera *camera, uint32_t index)
 {
-    g_return_val_if_fail(camera->has_set_mode, false);
-    g_return_val_if_fail(camera->num_buffers == 0, false);
+    struct v4l2_buffer buf = {
+        .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+        .memory = v4l2_memory[camera->memory],
+        .index = index,
+    };
+
+    switch (camera->memory) {
+        case MP_CAMERA_MEMORY_MMAP:
+            break;
+        case MP_CAMERA_MEMORY_USERPTR:
+            buf.m.userptr = (unsigned long)camera->buffers[index].data;
+            buf.length = camera->buffers[index].length;
+            break;
+        case MP_CAMERA_MEMORY_DMABUF:
+            buf.m.fd = camera->buffers[index].fd;
+            buf.length = camera->buffers[index].length;
+            break;
+    }
+
+    if (xioctl(camera->video_fd, VIDIOC_QBUF, &buf) == -1) {
+        errno_printerr("VIDIOC_QBUF");
+        return false;
+    }
+    return true;
+}
+
+// Wraps a buffer's memfd in a DMABUF the driver can import
+static int create_dmabuf(const MPCameraBuffer *buffer, size_t length)
+{
+    int udmabuf_fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+    if (udmabuf_fd == -1) {
+        return -1;
+    }
+
+    struct udmabuf_create create = {
+        .memfd = buffer->fd,
+        .flags = UDMABUF_FLAGS_CLOEXEC,
+        .offset = 0,
+        .size = length,
+    };
+    int fd = ioctl(udmabuf_fd, UDMABUF_CREATE, &create);
+    close(udmabuf_fd);
+    return fd;
+}
+
+static void free_buffers(MPCamera *camera)
+{
+    assert(camera->num_buffers <= MP_CAMERA_MAX_BUFFERS);
+    for (uint32_t i = 0; i < camera->num_buffers; ++i) {
+        switch (camera->memory) {
+            case MP_CAMERA_MEMORY_MMAP:
+                if (munmap(camera->buffers[i].data, camera->buffers[i].length) == -1) {
+                    errno_printerr("munmap");
+                }
+                break;
+            case MP_CAMERA_MEMORY_USERPTR:
+                break;
+            case MP_CAMERA_MEMORY_DMABUF:
+                close(camera->buffers[i].fd);
+                break;
+        }
+    }
+    camera->num_buffers = 0;
+    camera->num_dequeued = 0;
+
+    struct v4l2_requestbuffers req = {};
+    req.count = 0;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = v4l2_memory[camera->memory];
+    if (xioctl(camera->video_fd, VIDIOC_REQBUFS, &req) == -1) {
+        errno_printerr("VIDIOC_REQBUFS");
+    }
+}
+
+static bool start_capture(MPCamera *camera, MPCameraMemory memory, const MPCameraBuffer *buffers, uint32_t num_buffers)
+{
+    camera->memory = memory;
 
     // Start by requesting buffers
     struct v4l2_requestbuffers req = {};
-    req.count = MAX_VIDEO_BUFFERS;
+    req.count = num_buffers;
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
+    req.memory = v4l2_memory[memory];
 
     if (xioctl(camera->video_fd, VIDIOC_REQBUFS, &req) == -1) {
-        errno_printerr("VIDIOC_REQBUFS");
+        // Drivers that can't import memory are expected
+        if (memory == MP_CAMERA_MEMORY_MMAP || errno != EINVAL) {
+            errno_printerr("VIDIOC_REQBUFS");
+        }
         return false;
     }
 
@@ -289,51 +556,82 @@ bool mp_camera_start_capture(MPCamera *camera)
         goto error;
     }
 
-    for (uint32_t i = 0; i < req.count; ++i) {
-        // Query each buffer and mmap it
-        struct v4l2_buffer buf = {
-            .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-            .memory = V4L2_MEMORY_MMAP,
-            .index = i,
-        };
+    // The driver's own frame size, including any padding
+    struct v4l2_format fmt = {
+        .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+    };
+    if (memory != MP_CAMERA_MEMORY_MMAP && xioctl(camera->video_fd, VIDIOC_G_FMT, &fmt) == -1) {
+        errno_printerr("VIDIOC_G_FMT");
+        goto error;
+    }
 
-        if (xioctl(camera->video_fd, VIDIOC_QUERYBUF, &buf) == -1) {
-            errno_printerr("VIDIOC_QUERYBUF");
-            break;
-        }
+    for (uint32_t i = 0; i < req.count && i < MP_CAMERA_MAX_BUFFERS; ++i) {
+        struct video_buffer *buffer = &camera->buffers[i];
+        buffer->fd = -1;
 
-        camera->buffers[i].length = buf.length;
-        camera->buffers[i].data = mmap(
-            NULL,
-            buf.length,
-            PROT_READ,
-            MAP_SHARED,
-            camera->video_fd,
-            buf.m.offset);
-
-        if (camera->buffers[i].data == MAP_FAILED) {
-            errno_printerr("mmap");
-            break;
+        if (memory == MP_CAMERA_MEMORY_MMAP) {
+            // Query each buffer and mmap it
+            struct v4l2_buffer buf = {
+                .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+                .memory = V4L2_MEMORY_MMAP,
+                .index = i,
+            };
+
+            if (xioctl(camera->video_fd, VIDIOC_QUERYBUF, &buf) == -1) {
+                errno_printerr("VIDIOC_QUERYBUF");
+                break;
+            }
+
+            buffer->length = buf.length;
+            buffer->data = mmap(
+                NULL,
+                buf.length,
+                PROT_READ,
+                MAP_SHARED,
+                camera->video_fd,
+                buf.m.offset);
+
+            if (buffer->data == MAP_FAILED) {
+                errno_printerr("mmap");
+                break;
+            }
+        } else {
+            if (i >= num_buffers || buffers[i].length < fmt.fmt.pix.sizeimage) {
+                break;
+            }
+
+            buffer->length = buffers[i].length;
+            buffer->data = buffers[i].data;
+
+            if (memory == MP_CAMERA_MEMORY_DMABUF) {
+                if (buffers[i].fd == -1) {
+                    break;
+                }
+
+                // udmabuf only takes whole pages
+                size_t page_size = sysconf(_SC_PAGESIZE);
+                buffer->length = (buffer->length + page_size - 1) / page_size * page_size;
+                buffer->fd = create_dmabuf(&buffers[i], buffer->length);
+                if (buffer->fd == -1) {
+                    break;
+                }
+            }
         }
 
         ++camera->num_buffers;
     }
 
     if (camera->num_buffers != req.count) {
-        g_printerr("Unable to map all buffers\n");
+        if (memory == MP_CAMERA_MEMORY_MMAP) {
+            g_printerr("Unable to map all buffers\n");
+        }
         goto error;
     }
 
     for (uint32_t i = 0; i < camera->num_buffers; ++i) {
-        struct v4l2_buffer buf = {
-            .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-            .memory = V4L2_MEMORY_MMAP,
-            .index = i,
-        };
-
-        // Queue the buffer for capture
-        if (xioctl(camera->video_fd, VIDIOC_QBUF, &buf) == -1) {
-            errno_printerr("VIDIOC_QBUF");
+        // Queue the buffer for capture, drivers that need contiguous memory
+        // refuse imported memory here
+        if (!queue_buffer(camera, i)) {
             goto error;
         }
     }
@@ -348,27 +646,36 @@ bool mp_camera_start_capture(MPCamera *camera)
     return true;
 
 error:
-    // Unmap any mapped buffers
-    assert(camera->num_buffers <= MAX_VIDEO_BUFFERS);
-    for (uint32_t i = 0; i < camera->num_buffers; ++i) {
-        if (munmap(camera->buffers[i].data, camera->buffers[i].length) == -1) {
-            errno_printerr("munmap");
-        }
-    }
+    // Unmap any mapped buffers and reset the allocated ones
+    free_buffers(camera);
 
-    // Reset allocated buffers
-    {
-        struct v4l2_requestbuffers req = {};
-        req.count = 0;
-        req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        req.memory = V4L2_MEMORY_MMAP;
+    return false;
+}
 
-        if (xioctl(camera->video_fd, VIDIOC_REQBUFS, &req) == -1) {
-            errno_printerr("VIDIOC_REQBUFS");
-        }
+bool mp_camera_start_capture(MPCamera *camera, uint32_t num_buffers)
+{
+    g_return_val_if_fail(camera->has_set_mode, false);
+    g_return_val_if_fail(camera->num_buffers == 0, false);
+    g_return_val_if_fail(num_buffers <= MP_CAMERA_MAX_BUFFERS, false);
+
+    return start_capture(camera, MP_CAMERA_MEMORY_MMAP, NULL, num_buffers);
+}
+
+bool mp_camera_start_capture_into(MPCamera *camera, const MPCameraBuffer *buffers, uint32_t num_buffers)
+{
+    g_return_val_if_fail(camera->has_set_mode, false);
+    g_return_val_if_fail(camera->num_buffers == 0, false);
+    g_return_val_if_fail(num_buffers <= MP_CAMERA_MAX_BUFFERS, false);
+
+    if (start_capture(camera, MP_CAMERA_MEMORY_DMABUF, buffers, num_buffers)) {
+        return true;
+    }
+    if (start_capture(camera, MP_CAMERA_MEMORY_USERPTR, buffers, num_buffers)) {
+        return true;
     }
 
-    return false;
+    g_printerr("Driver can't capture into our buffers, using its own\n");
+    return start_capture(camera, MP_CAMERA_MEMORY_MMAP, NULL, num_buffers);
 }
 
 bool mp_camera_stop_capture(MPCamera *camera)
@@ -380,24 +687,19 @@ bool mp_camera_stop_capture(MPCamera *camera)
         errno_printerr("VIDIOC_STREAMOFF");
     }
 
-    assert(camera->num_buffers <= MAX_VIDEO_BUFFERS);
-    for (int i = 0; i < camera->num_buffers; ++i) {
-        if (munmap(camera->buffers[i].data, camera->buffers[i].length) == -1) {
-            errno_printerr("munmap");
-        }
-    }
+    free_buffers(camera);
 
-    camera->num_buffers = 0;
+    return true;
+}
 
-    struct v4l2_requestbuffers req = {};
-    req.count = 0;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
-    if (xioctl(camera->video_fd, VIDIOC_REQBUFS, &req) == -1) {
-        errno_printerr("VIDIOC_REQBUFS");
-    }
+MPCameraMemory mp_camera_get_memory(MPCamera *camera)
+{
+    return camera->memory;
+}
 
-    return true;
+uint32_t mp_camera_get_num_buffers(MPCamera *camera)
+{
+    return camera->num_buffers;
 }
 
 bool mp_camera_is_capturing(MPCamera *camera)
@@ -405,21 +707,38 @@ bool mp_camera_is_capturing(MPCamera *camera)
     return camera->num_buffers > 0;
 }
 
-bool mp_camera_capture_image(MPCamera *camera, void (*callback)(MPImage, void *), void *user_data)
+// vb2 doesn't maintain the CPU caches for imported DMABUFs, so reads through
+// our own mapping are bracketed by syncs. Without them non-coherent devices
+// can show stale cache lines.
+static void sync_dmabuf(MPCamera *camera, uint32_t index, uint64_t flags)
+{
+    if (camera->memory != MP_CAMERA_MEMORY_DMABUF) {
+        return;
+    }
+
+    struct dma_buf_sync sync = {
+        .flags = flags | DMA_BUF_SYNC_READ,
+    };
+    if (xioctl(camera->buffers[index].fd, DMA_BUF_IOCTL_SYNC, &sync) == -1) {
+        errno_printerr("DMA_BUF_IOCTL_SYNC");
+    }
+}
+
+int mp_camera_capture_buffer(MPCamera *camera, MPImage *image)
 {
     struct v4l2_buffer buf = {};
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
+    buf.memory = v4l2_memory[camera->memory];
     if (xioctl(camera->video_fd, VIDIOC_DQBUF, &buf) == -1) {
         switch (errno) {
             case EAGAIN:
-                return true;
+                return -1;
             case EIO:
                 /* Could ignore EIO, see spec. */
                 /* fallthrough */
             default:
                 errno_printerr("VIDIOC_DQBUF");
-                return false;
+                return -1;
         }
     }
 
@@ -427,28 +746,63 @@ bool mp_camera_capture_image(MPCamera *camera, void (*callback)(MPImage, void *)
     uint32_t width = camera->current_mode.width;
     uint32_t height = camera->current_mode.height;
 
-    assert(buf.bytesused == mp_pixel_format_bytes_per_pixel(pixel_format) * width * height);
-    assert(buf.bytesused == camera->buffers[buf.index].length);
+    assert(buf.bytesused == mp_pixel_format_width_to_bytes(pixel_format, width) * height);
+    assert(buf.bytesused <= camera->buffers[buf.index].length);
 
-    MPImage image = {
-        .pixel_format = pixel_format,
-        .width = width,
-        .height = height,
-        .data = camera->buffers[buf.index].data,
-    };
+    sync_dmabuf(camera, buf.index, DMA_BUF_SYNC_START);
 
-    callback(image, user_data);
+    image->pixel_format = pixel_format;
+    image->width = width;
+    image->height = height;
+    image->data = camera->buffers[buf.index].data;
+    image->sequence = buf.sequence;
+    image->timestamp = buf.timestamp.tv_sec * 1000000000ull + buf.timestamp.tv_usec * 1000ull;
+    image->flags = buf.flags;
+    image->fixed_exposure = camera->fixed_exposure;
+    image->fixed_gain = camera->fixed_gain;
 
-    // The callback may have stopped the capture, only queue the buffer if we're
-    // still capturing.
-    if (mp_camera_is_capturing(camera)) {
-        if (xioctl(camera->video_fd, VIDIOC_QBUF, &buf) == -1) {
-            errno_printerr("VIDIOC_QBUF");
-            return false;
-        }
+    ++camera->num_dequeued;
+
+    return buf.index;
+}
+
+bool mp_camera_release_buffer(MPCamera *camera, uint32_t index)
+{
+    // Stopping the capture already took every buffer back from the driver
+    if (!mp_camera_is_capturing(camera)) {
+        return true;
     }
 
-    return true;
+    assert(camera->num_dequeued > 0);
+    --camera->num_dequeued;
+
+    sync_dmabuf(camera, index, DMA_BUF_SYNC_END);
+    return queue_buffer(camera, index);
+}
+
+uint32_t mp_camera_get_num_queued_buffers(MPCamera *camera)
+{
+    return camera->num_buffers - camera->num_dequeued;
+}
+
+void mp_camera_set_fixed_exposure(MPCamera *camera, int32_t exposure, int32_t gain)
+{
+    camera->fixed_exposure = exposure;
+    camera->fixed_gain = gain;
+}
+
+bool mp_camera_capture_image(MPCamera *camera, void (*callback)(MPImage, void *), void *user_data)
+{
+    MPImage image;
+    int index = mp_camera_capture_buffer(camera, &image);
+    if (index < 0) {
+        return errno == EAGAIN;
+    }
+
+    callback(image, user_data);
+
+    // The callback may have stopped the capture, that's handled when releasing
+    return mp_camera_release_buffer(camera, index);
 }
 
 struct _MPCameraModeList {
@@ -643,6 +997,122 @@ MPCameraModeList *mp_camera_list_available_modes(MPCamera *camera)
     }
 }
 
+// The cache is a line with its key, followed by a line per mode
+static char *get_mode_cache_path(const char *model, const char *entity)
+{
+    char *name = g_strdup_printf("%s-%s", model, entity);
+    g_strdelimit(name, "/ ", '_');
+    char *path = g_build_filename(g_get_user_cache_dir(), "megapixels", "modes", name, NULL);
+    g_free(name);
+    return path;
+}
+
+static char *get_mode_cache_key(const char *model, const char *entity)
+{
+    // Drivers change what they support between kernels
+    struct utsname kernel;
+    if (uname(&kernel) == -1) {
+        return NULL;
+    }
+    return g_strdup_printf("%s %s %s %s", model, entity, kernel.release, kernel.version);
+}
+
+static MPCameraModeList *load_mode_cache(const char *path, const char *key, bool *found)
+{
+    *found = false;
+
+    char *contents;
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return NULL;
+    }
+
+    MPCameraModeList *list = NULL;
+    MPCameraModeList **tail = &list;
+
+    char **lines = g_strsplit(contents, "\n", -1);
+    if (lines[0] && strcmp(lines[0], key) == 0) {
+        *found = true;
+        for (char **line = lines + 1; *line && **line; ++line) {
+            char format[16];
+            MPCameraMode mode;
+            if (sscanf(*line, "%15s %u %u %u %u",
+                       format,
+                       &mode.width,
+                       &mode.height,
+                       &mode.frame_interval.numerator,
+                       &mode.frame_interval.denominator) != 5
+                || (mode.pixel_format = mp_pixel_format_from_str(format)) == MP_PIXEL_FMT_UNSUPPORTED) {
+                // Written by a version that knew other formats
+                *found = false;
+                break;
+            }
+
+            MPCameraModeList *item = malloc(sizeof(MPCameraModeList));
+            item->mode = mode;
+            item->next = NULL;
+            *tail = item;
+            tail = &item->next;
+        }
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    if (!*found) {
+        mp_camera_mode_list_free(list);
+        return NULL;
+    }
+    return list;
+}
+
+static void store_mode_cache(const char *path, const char *key, MPCameraModeList *list)
+{
+    GString *contents = g_string_new(key);
+    g_string_append_c(contents, '\n');
+    for (; list; list = list->next) {
+        g_string_append_printf(contents, "%s %u %u %u %u\n",
+                               mp_pixel_format_to_str(list->mode.pixel_format),
+                               list->mode.width,
+                               list->mode.height,
+                               list->mode.frame_interval.numerator,
+                               list->mode.frame_interval.denominator);
+    }
+
+    char *dir = g_path_get_dirname(path);
+    GError *error = NULL;
+    if (g_mkdir_with_parents(dir, 0755) == -1
+        || !g_file_set_contents(path, contents->str, contents->len, &error)) {
+        g_printerr("Could not write the mode cache %s: %s\n", path, error ? error->message : strerror(errno));
+        g_clear_error(&error);
+    }
+    g_free(dir);
+    g_string_free(contents, true);
+}
+
+MPCameraModeList *mp_camera_list_available_modes_cached(MPCamera *camera, const char *model, const char *entity)
+{
+    char *key = get_mode_cache_key(model, entity);
+    if (!key) {
+        return mp_camera_list_available_modes(camera);
+    }
+
+    char *path = get_mode_cache_path(model, entity);
+
+    bool found;
+    MPCameraModeList *list = load_mode_cache(path, key, &found);
+    if (!found) {
+        list = mp_camera_list_available_modes(camera);
+
+        // Nothing was found, maybe only this time
+        if (list) {
+            store_mode_cache(path, key, list);
+        }
+    }
+
+    g_free(path);
+    g_free(key);
+    return list;
+}
+
 MPCameraMode *mp_camera_mode_list_get(MPCameraModeList *list)
 {
     g_return_val_if_fail(list, NULL);
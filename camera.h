@@ -2,6 +2,7 @@
 
 #include <linux/v4l2-subdev.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef enum {
@@ -10,6 +11,25 @@ typedef enum {
     MP_PIXEL_FMT_GBRG8,
     MP_PIXEL_FMT_GRBG8,
     MP_PIXEL_FMT_RGGB8,
+    // 10 and 12 bits stored in the low bits of 16-bit little endian words
+    MP_PIXEL_FMT_BGGR10,
+    MP_PIXEL_FMT_GBRG10,
+    MP_PIXEL_FMT_GRBG10,
+    MP_PIXEL_FMT_RGGB10,
+    MP_PIXEL_FMT_BGGR12,
+    MP_PIXEL_FMT_GBRG12,
+    MP_PIXEL_FMT_GRBG12,
+    MP_PIXEL_FMT_RGGB12,
+    // MIPI packing, the top 8 bits of 4 samples followed by a byte of the
+    // low bits, or of 2 samples for 12 bits
+    MP_PIXEL_FMT_BGGR10P,
+    MP_PIXEL_FMT_GBRG10P,
+    MP_PIXEL_FMT_GRBG10P,
+    MP_PIXEL_FMT_RGGB10P,
+    MP_PIXEL_FMT_BGGR12P,
+    MP_PIXEL_FMT_GBRG12P,
+    MP_PIXEL_FMT_GRBG12P,
+    MP_PIXEL_FMT_RGGB12P,
 
     MP_PIXEL_FMT_MAX,
 } MPPixelFormat;
@@ -22,7 +42,10 @@ MPPixelFormat mp_pixel_format_from_v4l_bus_code(uint32_t v4l_bus_code);
 uint32_t mp_pixel_format_to_v4l_pixel_format(MPPixelFormat pixel_format);
 uint32_t mp_pixel_format_to_v4l_bus_code(MPPixelFormat pixel_format);
 
-uint32_t mp_pixel_format_bytes_per_pixel(MPPixelFormat pixel_format);
+uint32_t mp_pixel_format_bits_per_pixel(MPPixelFormat pixel_format);
+uint32_t mp_pixel_format_width_to_bytes(MPPixelFormat pixel_format, uint32_t width);
+// Expands a row of a deeper than 8-bit format to one 16-bit sample per pixel
+void mp_pixel_format_unpack_row(MPPixelFormat pixel_format, const uint8_t *src, uint32_t width, uint16_t *dst);
 
 typedef struct {
     MPPixelFormat pixel_format;
@@ -39,6 +62,17 @@ typedef struct {
     uint32_t width;
     uint32_t height;
     uint8_t *data;
+
+    // V4L2 frame counter and CLOCK_MONOTONIC timestamp in nanoseconds
+    uint32_t sequence;
+    uint64_t timestamp;
+    // V4L2_BUF_FLAG_*, V4L2_BUF_FLAG_ERROR marks a corrupted frame
+    uint32_t flags;
+    // Exposure in sensor rows and gain while they were fixed, e.g. for a
+    // burst, or 0 while the sensor controls them. Not read back per frame, see
+    // mp_camera_set_fixed_exposure.
+    int32_t fixed_exposure;
+    int32_t fixed_gain;
 } MPImage;
 
 typedef struct _MPCamera MPCamera;
@@ -54,15 +88,61 @@ const MPCameraMode *mp_camera_get_mode(const MPCamera *camera);
 bool mp_camera_try_mode(MPCamera *camera, MPCameraMode *mode);
 
 bool mp_camera_set_mode(MPCamera *camera, MPCameraMode *mode);
-bool mp_camera_start_capture(MPCamera *camera);
+// Only sets the mode of the sensor, which keeps it while another camera uses
+// the video device. Setting the same mode again later skips the sensor.
+bool mp_camera_prepare_mode(MPCamera *camera, MPCameraMode *mode);
+
+typedef enum {
+    // Buffers allocated by the driver and mapped read only
+    MP_CAMERA_MEMORY_MMAP,
+    MP_CAMERA_MEMORY_USERPTR,
+    MP_CAMERA_MEMORY_DMABUF,
+} MPCameraMemory;
+
+// Memory owned by the application for the driver to capture into
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    // A sealed memfd holding the memory, rounded up to whole pages, to import
+    // it as a DMABUF through udmabuf, or -1
+    int fd;
+} MPCameraBuffer;
+
+// How many buffers to capture into is up to the caller, up to this many
+#define MP_CAMERA_MAX_BUFFERS 32
+
+// The driver may adjust num_buffers, see mp_camera_get_num_buffers
+bool mp_camera_start_capture(MPCamera *camera, uint32_t num_buffers);
+// Captures into the given buffers, imported as DMABUFs or user pointers
+// depending on what the driver takes, or into as many of its own buffers if it
+// takes neither. The buffers have to stay alive until the capture is stopped.
+bool mp_camera_start_capture_into(MPCamera *camera, const MPCameraBuffer *buffers, uint32_t num_buffers);
+MPCameraMemory mp_camera_get_memory(MPCamera *camera);
+uint32_t mp_camera_get_num_buffers(MPCamera *camera);
 bool mp_camera_stop_capture(MPCamera *camera);
 bool mp_camera_is_capturing(MPCamera *camera);
+// Calls callback with the next frame and queues its buffer again right after
 bool mp_camera_capture_image(MPCamera *camera, void (*callback)(MPImage, void *), void *user_data);
+// Takes the next frame without queueing its buffer again, the image stays
+// valid until the buffer is released. Returns the buffer index, or -1 with
+// errno set to EAGAIN if no frame was ready yet, or to the error.
+int mp_camera_capture_buffer(MPCamera *camera, MPImage *image);
+bool mp_camera_release_buffer(MPCamera *camera, uint32_t index);
+// Buffers the driver can still fill
+uint32_t mp_camera_get_num_queued_buffers(MPCamera *camera);
+// Drivers don't report the exposure and gain of every frame, so whoever fixes
+// them tells the camera to put these settings on the frames captured from now
+// on. 0 once they're no longer fixed, e.g. when the sensor controls them again.
+void mp_camera_set_fixed_exposure(MPCamera *camera, int32_t exposure, int32_t gain);
 
 typedef struct _MPCameraModeList MPCameraModeList;
 
 MPCameraModeList *mp_camera_list_supported_modes(MPCamera *camera);
 MPCameraModeList *mp_camera_list_available_modes(MPCamera *camera);
+// Same as mp_camera_list_available_modes, but cached in $XDG_CACHE_HOME for the
+// model of the media device, the name of the sensor's entity and the running
+// kernel. Enumerating takes an ioctl for every format, size and interval.
+MPCameraModeList *mp_camera_list_available_modes_cached(MPCamera *camera, const char *model, const char *entity);
 MPCameraMode *mp_camera_mode_list_get(MPCameraModeList *list);
 MPCameraModeList *mp_camera_mode_list_next(MPCameraModeList *list);
 void mp_camera_mode_list_free(MPCameraModeList *list);
@@ -0,0 +1,261 @@
+// For memfd_create
+#define _GNU_SOURCE
+
+#include "framepool.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct frame {
+    uint8_t *data;
+    size_t size;
+    // A sealed memfd holding the frame, so the camera can capture into it, or
+    // -1 when the frame is anonymous memory
+    int fd;
+};
+
+struct _MPFramePool {
+    pthread_mutex_t lock;
+
+    size_t size;
+
+    size_t count;
+    struct frame *frames;
+    // Most frames that may be in use, the free frames above it aren't
+    // allocated
+    size_t limit;
+
+    // Indices of the free frames, used as a stack so the most recently
+    // released and likely still cached buffer is handed out first. Only the
+    // top ones, up to the limit, are allocated.
+    size_t *free;
+    size_t num_free;
+
+    MPFramePoolStats stats;
+};
+
+static size_t page_align(size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    return (size + page_size - 1) / page_size * page_size;
+}
+
+static void frame_alloc(struct frame *frame, size_t size)
+{
+    if (frame->data) {
+        munmap(frame->data, page_align(frame->size));
+    }
+    if (frame->fd != -1) {
+        close(frame->fd);
+    }
+    frame->data = NULL;
+    frame->size = size;
+    frame->fd = -1;
+
+    if (size == 0) {
+        return;
+    }
+
+    // Whole pages, the driver DMAs into them and udmabuf only takes pages
+    size_t length = page_align(size);
+
+    int fd = memfd_create("megapixels-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd != -1) {
+        if (ftruncate(fd, length) == 0
+            && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) == 0) {
+            void *data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (data != MAP_FAILED) {
+                frame->data = data;
+                frame->fd = fd;
+            }
+        }
+        if (frame->fd == -1) {
+            close(fd);
+        }
+    }
+
+    if (!frame->data) {
+        void *data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(data != MAP_FAILED);
+        frame->data = data;
+    }
+
+    // Fault every page in now, not while the first frames arrive
+    memset(frame->data, 0, size);
+}
+
+static void frame_free(struct frame *frame)
+{
+    frame_alloc(frame, 0);
+}
+
+MPFramePool *mp_frame_pool_new(size_t count)
+{
+    MPFramePool *pool = malloc(sizeof(MPFramePool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->size = 0;
+    pool->count = count;
+    pool->limit = count;
+    pool->frames = calloc(count, sizeof(struct frame));
+    for (size_t i = 0; i < count; ++i) {
+        pool->frames[i].fd = -1;
+    }
+    pool->free = malloc(sizeof(size_t) * count);
+    pool->num_free = count;
+    for (size_t i = 0; i < count; ++i) {
+        pool->free[i] = i;
+    }
+    memset(&pool->stats, 0, sizeof(MPFramePoolStats));
+    return pool;
+}
+
+// Frees buffers that are still in use too, so the threads using them have to
+// be stopped first
+void mp_frame_pool_free(MPFramePool *pool)
+{
+    for (size_t i = 0; i < pool->count; ++i) {
+        frame_free(&pool->frames[i]);
+    }
+    free(pool->frames);
+    free(pool->free);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+// Free frames that may be handed out, only those are allocated
+static size_t get_num_allocated_free(MPFramePool *pool)
+{
+    size_t in_use = pool->count - pool->num_free;
+    if (in_use >= pool->limit) {
+        return 0;
+    }
+    return pool->limit - in_use < pool->num_free ? pool->limit - in_use : pool->num_free;
+}
+
+void mp_frame_pool_set_size(MPFramePool *pool, size_t size)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    if (size != pool->size) {
+        pool->size = size;
+
+        for (size_t i = pool->num_free - get_num_allocated_free(pool); i < pool->num_free; ++i) {
+            frame_alloc(&pool->frames[pool->free[i]], size);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void mp_frame_pool_set_limit(MPFramePool *pool, size_t limit)
+{
+    assert(limit <= pool->count);
+
+    pthread_mutex_lock(&pool->lock);
+
+    pool->limit = limit;
+
+    size_t allocated_start = pool->num_free - get_num_allocated_free(pool);
+    for (size_t i = 0; i < pool->num_free; ++i) {
+        struct frame *frame = &pool->frames[pool->free[i]];
+        size_t size = i < allocated_start ? 0 : pool->size;
+        if (frame->size != size || (size > 0 && !frame->data)) {
+            frame_alloc(frame, size);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+size_t mp_frame_pool_get_count(MPFramePool *pool)
+{
+    return pool->count;
+}
+
+size_t mp_frame_pool_get_size(MPFramePool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    size_t size = pool->size;
+    pthread_mutex_unlock(&pool->lock);
+    return size;
+}
+
+uint8_t *mp_frame_pool_acquire(MPFramePool *pool)
+{
+    uint8_t *data = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (get_num_allocated_free(pool) == 0) {
+        ++pool->stats.exhausted;
+    } else {
+        struct frame *frame = &pool->frames[pool->free[--pool->num_free]];
+        assert(frame->size == pool->size);
+        data = frame->data;
+
+        size_t in_use = pool->count - pool->num_free;
+        if (in_use > pool->stats.high_water_mark) {
+            pool->stats.high_water_mark = in_use;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return data;
+}
+
+static size_t find_frame(MPFramePool *pool, const uint8_t *data)
+{
+    size_t index = 0;
+    while (index < pool->count && pool->frames[index].data != data) {
+        ++index;
+    }
+    assert(index < pool->count);
+    return index;
+}
+
+void mp_frame_pool_release(MPFramePool *pool, uint8_t *data)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    size_t index = find_frame(pool, data);
+
+    size_t in_use = pool->count - pool->num_free;
+    if (in_use > pool->limit) {
+        // The limit was lowered while this buffer was in use, it goes below
+        // the allocated frames
+        frame_free(&pool->frames[index]);
+        memmove(pool->free + 1, pool->free, sizeof(size_t) * pool->num_free);
+        pool->free[0] = index;
+        ++pool->num_free;
+    } else {
+        // The frame size changed while this buffer was in use
+        if (pool->frames[index].size != pool->size) {
+            frame_alloc(&pool->frames[index], pool->size);
+        }
+
+        pool->free[pool->num_free++] = index;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int mp_frame_pool_get_fd(MPFramePool *pool, const uint8_t *data)
+{
+    pthread_mutex_lock(&pool->lock);
+    int fd = pool->frames[find_frame(pool, data)].fd;
+    pthread_mutex_unlock(&pool->lock);
+    return fd;
+}
+
+void mp_frame_pool_get_stats(MPFramePool *pool, MPFramePoolStats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
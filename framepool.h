@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A fixed number of preallocated frame buffers, handed from the capture thread
+// to the process thread and back without touching the allocator. Buffers are
+// page aligned and backed by a memfd where possible, so the camera can capture
+// straight into them.
+typedef struct _MPFramePool MPFramePool;
+
+typedef struct {
+    // Most buffers ever in use at once
+    size_t high_water_mark;
+    // Number of times there was no free buffer
+    size_t exhausted;
+} MPFramePoolStats;
+
+MPFramePool *mp_frame_pool_new(size_t count);
+void mp_frame_pool_free(MPFramePool *pool);
+
+// Reallocates the buffers if size differs from the current frame size, buffers
+// that are in use are reallocated when they are released
+void mp_frame_pool_set_size(MPFramePool *pool, size_t size);
+size_t mp_frame_pool_get_size(MPFramePool *pool);
+// Only allocates and hands out limit of the count buffers, buffers above it
+// that are in use are freed when they are released
+void mp_frame_pool_set_limit(MPFramePool *pool, size_t limit);
+size_t mp_frame_pool_get_count(MPFramePool *pool);
+
+// Returns NULL if every buffer is in use
+uint8_t *mp_frame_pool_acquire(MPFramePool *pool);
+void mp_frame_pool_release(MPFramePool *pool, uint8_t *data);
+// The memfd of an acquired buffer, the size rounded up to a whole page long,
+// or -1
+int mp_frame_pool_get_fd(MPFramePool *pool, const uint8_t *data);
+
+void mp_frame_pool_get_stats(MPFramePool *pool, MPFramePoolStats *stats);
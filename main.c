@@ -8,6 +8,7 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <assert.h>
+#include <stdatomic.h>
 #include <limits.h>
 #include <math.h>
 #include <linux/kdev_t.h>
@@ -23,6 +24,8 @@
 #include "camera.h"
 #include "device.h"
 #include "pipeline.h"
+#include "framepool.h"
+#include "trace.h"
 
 enum user_control {
 	USER_CONTROL_ISO,
@@ -44,12 +47,19 @@ struct camerainfo {
 	MPCameraMode camera_mode;
 	int fd;
 	int rotate;
+	QuickDebayerMode preview_mode;
+	int preview_matrix;
 
 	float colormatrix[9];
 	float forwardmatrix[9];
 	int blacklevel;
 	int whitelevel;
 
+	// Tone tables for the preview, built from the levels above
+	QuickDebayerLut preview_lut;
+	// Depth of the format preview_lut was made for, 0 before the first capture
+	int preview_lut_bits;
+
 	float focallength;
 	float cropfactor;
 	double fnumber;
@@ -61,14 +71,33 @@ struct camerainfo {
 
 	int has_af_c;
 	int has_af_s;
+
+	// Buffers to capture into, 0 to fit them to the buffer budget
+	int num_buffers;
+	// The driver can't capture into our buffers, so it uses its own
+	bool driver_buffers;
+	// Kept while the other camera is in use, so switching back doesn't
+	// allocate them again
+	MPFramePool *capture_pool;
 };
 
+// White balance of the captured frames, there is no auto white balance yet
+static const float as_shot_neutral[] = {1.0, 1.0, 1.0};
+
 static float colormatrix_srgb[] = {
 	3.2409, -1.5373, -0.4986,
 	-0.9692, 1.8759, 0.0415,
 	0.0556, -0.2039, 1.0569
 };
 
+// XYZ with a D50 white point, which the forward matrices map to, to linear
+// sRGB with Bradford adaptation to D65
+static const float xyz_d50_to_srgb[] = {
+	3.1339, -1.6169, -0.4906,
+	-0.9788, 1.9161, 0.0335,
+	0.0719, -0.2290, 1.4052
+};
+
 struct camerainfo rear_cam;
 struct camerainfo front_cam;
 struct camerainfo *current_cam;
@@ -81,8 +110,20 @@ static int video_fd;
 static char *exif_make;
 static char *exif_model;
 
+// Scheduling of the pipeline threads, from the capture-*, process-* and burst-*
+// keys in [device]
+static MPPipelineSchedule capture_schedule = {};
+static MPPipelineSchedule process_schedule = {};
+static MPPipelineSchedule burst_schedule = {};
+
+// Memory the capture buffers and copies may take, together with the buffers
+// kept for the other camera, see get_num_capture_buffers
+static size_t buffer_budget = 64 * 1024 * 1024;
+
 // State
 static cairo_surface_t *surface = NULL;
+// Frame the preview surface shows, for tracing
+static uint32_t preview_sequence = 0;
 static cairo_surface_t *status_surface = NULL;
 static int preview_width = -1;
 static int preview_height = -1;
@@ -92,7 +133,6 @@ static int exposure = 1;
 static int auto_gain = 1;
 static int gain = 1;
 static int burst_length = 10;
-static char burst_dir[23];
 static char processing_script[512];
 static enum user_control current_control;
 // Widgets
@@ -302,8 +342,10 @@ register_custom_tiff_tags(TIFF *tif)
 static gboolean
 preview_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
 {
+	uint64_t trace_start = mp_trace_begin();
 	cairo_set_source_surface(cr, surface, 0, 0);
 	cairo_paint(cr);
+	mp_trace_end(MP_TRACE_PREVIEW_DRAW, preview_sequence, trace_start);
 	return FALSE;
 }
 
@@ -362,6 +404,14 @@ config_ini_handler(void *user, const char *section, const char *name,
 			cc->camera_mode.frame_interval.denominator = strtoint(value, NULL, 10);
 		} else if (strcmp(name, "rotate") == 0) {
 			cc->rotate = strtoint(value, NULL, 10);
+		} else if (strcmp(name, "preview-matrix") == 0) {
+			cc->preview_matrix = strtoint(value, NULL, 10);
+		} else if (strcmp(name, "preview-mode") == 0) {
+			cc->preview_mode = quick_debayer_mode_from_str(value);
+			if (cc->preview_mode == QUICK_DEBAYER_MODE_MAX) {
+				g_printerr("Unsupported preview mode %s\n", value);
+				exit(1);
+			}
 		} else if (strcmp(name, "fmt") == 0) {
 			cc->camera_mode.pixel_format = mp_pixel_format_from_str(value);
 			if (cc->camera_mode.pixel_format == MP_PIXEL_FMT_UNSUPPORTED) {
@@ -408,6 +458,8 @@ config_ini_handler(void *user, const char *section, const char *name,
 			cc->iso_min = strtod(value, NULL);
 		} else if (strcmp(name, "iso-max") == 0) {
 			cc->iso_max = strtod(value, NULL);
+		} else if (strcmp(name, "buffers") == 0) {
+			cc->num_buffers = strtoint(value, NULL, 10);
 		} else {
 			g_printerr("Unknown key '%s' in [%s]\n", name, section);
 			exit(1);
@@ -419,6 +471,30 @@ config_ini_handler(void *user, const char *section, const char *name,
 			exif_make = strdup(value);
 		} else if (strcmp(name, "model") == 0) {
 			exif_model = strdup(value);
+		} else if (strcmp(name, "buffer-budget") == 0) {
+			char *end;
+			errno = 0;
+			long mib = strtol(value, &end, 10);
+			if (errno != 0 || end == value || *end != '\0' || mib <= 0 || (unsigned long)mib > SIZE_MAX >> 20) {
+				g_printerr("Invalid value '%s' for '%s' in [device]\n", value, name);
+				exit(1);
+			}
+			buffer_budget = (size_t)mib << 20;
+		} else if (strncmp(name, "capture-", 8) == 0) {
+			if (!mp_pipeline_schedule_parse(&capture_schedule, name + 8, value)) {
+				g_printerr("Invalid value '%s' for '%s' in [device]\n", value, name);
+				exit(1);
+			}
+		} else if (strncmp(name, "process-", 8) == 0) {
+			if (!mp_pipeline_schedule_parse(&process_schedule, name + 8, value)) {
+				g_printerr("Invalid value '%s' for '%s' in [device]\n", value, name);
+				exit(1);
+			}
+		} else if (strncmp(name, "burst-", 6) == 0) {
+			if (!mp_pipeline_schedule_parse(&burst_schedule, name + 6, value)) {
+				g_printerr("Invalid value '%s' for '%s' in [device]\n", value, name);
+				exit(1);
+			}
 		} else {
 			g_printerr("Unknown key '%s' in [device]\n", name);
 			exit(1);
@@ -434,30 +510,83 @@ static MPDevice *device = NULL;
 static MPPipeline *capture_pipeline = NULL;
 static MPPipelineCapture *pipeline_capture = NULL;
 static MPPipeline *process_pipeline = NULL;
+// Writes the frames of a burst on every core
+static MPPipeline *burst_pipeline = NULL;
+
+// Frames are processed straight from the camera's buffers. Only when holding
+// on to another one would leave the driver with fewer than this many to fill,
+// e.g. while a burst is being saved, the frame is copied to the pool instead.
+#define MIN_QUEUED_BUFFERS 4
+
+// Frames the preview holds on to at most, one in every slot of its mailbox
+#define PREVIEW_DEPTH 3
+// Longest the capture thread may not get to run without frames being dropped
+#define MAX_CAPTURE_STALL_MS 250
+// Copies for the frame being previewed and the next one
+#define PREVIEW_COPIES 2
+
+// Room for a whole burst plus the preview copies, but only the copies the
+// capture buffers can't stand in for are allocated, see get_num_copy_buffers
+static MPFramePool *frame_pool = NULL;
+
+// The camera captures into the buffers of its capture_pool when its driver can
+// import them, these are the ones in use
+static MPCameraBuffer capture_buffers[MP_CAMERA_MAX_BUFFERS];
+static uint32_t num_capture_buffers = 0;
+
+// Time the camera switch started, until its first frame arrives. Only used on
+// the capture thread.
+static uint64_t switch_start = 0;
 
 struct update_preview_args {
-	GdkPixbuf *pixbuf;
+	cairo_surface_t *image;
 	bool update_thumbnail;
+	uint32_t sequence;
 };
 
-static bool update_preview(struct update_preview_args *args)
+// Set on the main thread, the process thread doesn't debayer while the preview
+// isn't on screen
+static atomic_bool preview_visible = false;
+
+// The newest debayered frame that wasn't drawn yet, the main thread draws at
+// most one per frame of the display
+static struct update_preview_args *_Atomic pending_preview = NULL;
+static guint preview_tick_id = 0;
+
+static void free_update_preview_args(struct update_preview_args *args)
 {
-	if (!surface)
-		return false;
+	cairo_surface_destroy(args->image);
+	free(args);
+}
+
+static void update_preview(struct update_preview_args *args)
+{
+	uint64_t trace_start = mp_trace_begin();
+
+	if (!surface) {
+		free_update_preview_args(args);
+		return;
+	}
+
+	int width = cairo_image_surface_get_width(args->image);
+	int height = cairo_image_surface_get_height(args->image);
 
 	if (args->update_thumbnail)
 	{
-		GdkPixbuf *thumb = gdk_pixbuf_scale_simple(args->pixbuf, 24, 24, GDK_INTERP_BILINEAR);
+		GdkPixbuf *pixbuf = gdk_pixbuf_get_from_surface(args->image, 0, 0, width, height);
+		GdkPixbuf *thumb = gdk_pixbuf_scale_simple(pixbuf, 24, 24, GDK_INTERP_BILINEAR);
 		gtk_image_set_from_pixbuf(GTK_IMAGE(thumb_last), thumb);
+		g_object_unref(thumb);
+		g_object_unref(pixbuf);
 	}
 
 	// Draw preview image
-	double scale = (double) preview_width / gdk_pixbuf_get_width(args->pixbuf);
+	double scale = (double) preview_width / width;
 	cairo_t *cr = cairo_create(surface);
 	cairo_set_source_rgb(cr, 0, 0, 0);
 	cairo_paint(cr);
 	cairo_scale(cr, scale, scale);
-	gdk_cairo_set_source_pixbuf(cr, args->pixbuf, 0, 0);
+	cairo_set_source_surface(cr, args->image, 0, 0);
 	cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_NONE);
 	cairo_paint(cr);
 
@@ -471,89 +600,234 @@ static bool update_preview(struct update_preview_args *args)
 	// Queue gtk3 repaint of the preview area
 	gtk_widget_queue_draw_area(preview, 0, 0, preview_width, preview_height);
 
-	g_object_unref(args->pixbuf);
+	preview_sequence = args->sequence;
+	mp_trace_end(MP_TRACE_UPDATE_PREVIEW, args->sequence, trace_start);
+
+	free_update_preview_args(args);
+}
+
+static gboolean preview_tick(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer data)
+{
+	struct update_preview_args *args = atomic_exchange(&pending_preview, NULL);
+	if (!args) {
+		// Stop ticking until the next frame arrives
+		preview_tick_id = 0;
+		return G_SOURCE_REMOVE;
+	}
 
+	update_preview(args);
+	return G_SOURCE_CONTINUE;
+}
+
+static bool request_preview_tick(gpointer data)
+{
+	if (!preview_tick_id) {
+		preview_tick_id = gtk_widget_add_tick_callback(preview, preview_tick, NULL, NULL);
+	}
 	return false;
 }
 
+static void update_preview_visible()
+{
+	GdkWindow *window = gtk_widget_get_window(gtk_widget_get_toplevel(preview));
+	bool iconified = window && (gdk_window_get_state(window) & GDK_WINDOW_STATE_ICONIFIED);
+	atomic_store(&preview_visible, gtk_widget_get_mapped(preview) && !iconified);
+}
+
+// The stack unmaps the preview while the settings are shown
+static void on_preview_map_changed(GtkWidget *widget, gpointer data)
+{
+	update_preview_visible();
+}
+
+static gboolean on_window_state_changed(GtkWidget *widget, GdkEventWindowState *event, gpointer data)
+{
+	update_preview_visible();
+	return FALSE;
+}
+
+static QuickDebayerPool *debayer_pool = NULL;
+
+// Images the preview is debayered into, owned by the process thread. The main
+// thread holds an extra reference while an image is queued for drawing, so
+// one is free to be overwritten again once it only has our reference left.
+#define PREVIEW_IMAGES 3
+static cairo_surface_t *preview_images[PREVIEW_IMAGES] = {0};
+
+static cairo_surface_t *get_preview_image(int width, int height)
+{
+	int idle = -1;
+	for (int i = 0; i < PREVIEW_IMAGES; ++i) {
+		cairo_surface_t *image = preview_images[i];
+		if (image && cairo_surface_get_reference_count(image) > 1) {
+			continue;
+		}
+
+		if (image
+		    && cairo_image_surface_get_width(image) == width
+		    && cairo_image_surface_get_height(image) == height) {
+			return image;
+		}
+
+		if (idle < 0) {
+			idle = i;
+		}
+	}
+
+	// Every image is still waiting to be drawn
+	if (idle < 0) {
+		return NULL;
+	}
+
+	if (preview_images[idle]) {
+		cairo_surface_destroy(preview_images[idle]);
+	}
+	preview_images[idle] = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	return preview_images[idle];
+}
+
+static void free_preview_images()
+{
+	for (int i = 0; i < PREVIEW_IMAGES; ++i) {
+		if (preview_images[i]) {
+			cairo_surface_destroy(preview_images[i]);
+			preview_images[i] = NULL;
+		}
+	}
+}
+
 static void process_image_for_preview(const MPImage *image, bool update_thumbnail)
 {
-	int skip = 0;
-	if (current_cam->rotate == 0 || current_cam->rotate == 180) {
-		skip = round((image->width / 2) / (float)preview_width);
-	} else {
-		skip = round((image->width / 2) / (float)preview_height);
-	}
-	skip += 1;
-
-	if (skip < 0) {
-		skip = 0;
-	} else if (skip > 3) {
-		skip = 3;
-	}
-
-	GdkPixbuf *pixbuf = gdk_pixbuf_new(
-		GDK_COLORSPACE_RGB,
-		FALSE,
-		8,
-		image->width / (skip*2),
-		image->height / (skip*2));
-
-	guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
-	quick_debayer_bggr8(
-		(const uint8_t *)image->data,
-		pixels,
-		image->width,
-		image->height,
-		skip,
-		current_cam->blacklevel);
-
-	GdkPixbuf *pixbufrot;
-	if (current_cam->rotate == 0) {
-		pixbufrot = pixbuf;
-	} else if (current_cam->rotate == 90) {
-		pixbufrot = gdk_pixbuf_rotate_simple(pixbuf, GDK_PIXBUF_ROTATE_COUNTERCLOCKWISE);
-	} else if (current_cam->rotate == 180) {
-		pixbufrot = gdk_pixbuf_rotate_simple(pixbuf, GDK_PIXBUF_ROTATE_UPSIDEDOWN);
-	} else if (current_cam->rotate == 270) {
-		pixbufrot = gdk_pixbuf_rotate_simple(pixbuf, GDK_PIXBUF_ROTATE_CLOCKWISE);
-	}
-
-	if (pixbuf != pixbufrot) {
-		g_object_unref(pixbuf);
+	if (!quick_debayer_format_supported(image->pixel_format)) {
+		g_printerr("Unsupported pixel format %s\n", mp_pixel_format_to_str(image->pixel_format));
+		return;
+	}
+
+	if (preview_width <= 0) {
+		// Nothing to draw into yet
+		return;
+	}
+
+	// Nobody would see it, but a finished burst still needs its thumbnail
+	if (!atomic_load(&preview_visible) && !update_thumbnail) {
+		return;
+	}
+
+	// Debayer at exactly the width of the preview, keeping the aspect ratio.
+	// Past one pixel per bayer cell cairo scales the rest of the way up.
+	int cells_x = image->width / 2;
+	int cells_y = image->height / 2;
+	if (current_cam->rotate == 90 || current_cam->rotate == 270) {
+		int tmp = cells_x;
+		cells_x = cells_y;
+		cells_y = tmp;
+	}
+	int width = MIN(preview_width, cells_x);
+	int height = MAX(1, round((double)cells_y * width / cells_x));
+
+	// The debayer writes the image already rotated, in the pixel layout
+	// cairo paints from directly
+	QuickDebayerParams params = {
+		.width = image->width,
+		.height = image->height,
+		.dest_width = width,
+		.dest_height = height,
+		.mode = current_cam->preview_mode,
+		.lut = &current_cam->preview_lut,
+		.rotation = current_cam->rotate,
+		.output = QUICK_DEBAYER_OUTPUT_XRGB8888,
+	};
+
+	cairo_surface_t *preview_image = get_preview_image(width, height);
+	if (!preview_image) {
+		// The main thread is behind, drop this frame
+		return;
 	}
 
+	uint64_t trace_start = mp_trace_begin();
+	cairo_surface_flush(preview_image);
+	params.stride = cairo_image_surface_get_stride(preview_image);
+	quick_debayer_parallel(debayer_pool, image->pixel_format, (const uint8_t *)image->data, cairo_image_surface_get_data(preview_image), &params);
+	cairo_surface_mark_dirty(preview_image);
+	mp_trace_end(MP_TRACE_DEBAYER, image->sequence, trace_start);
+
 	struct update_preview_args *args = malloc(sizeof(struct update_preview_args));
-	args->pixbuf = pixbufrot;
+	args->image = cairo_surface_reference(preview_image);
 	args->update_thumbnail = update_thumbnail;
+	args->sequence = image->sequence;
+
+	mp_trace_instant(MP_TRACE_HANDOFF, image->sequence);
+
+	// Replace a frame the main thread didn't get to yet, but keep the
+	// thumbnail update it would have done
+	struct update_preview_args *previous = atomic_exchange(&pending_preview, args);
+	if (previous) {
+		args->update_thumbnail |= previous->update_thumbnail;
+		free_update_preview_args(previous);
+	} else {
+		g_main_context_invoke(g_main_context_default(), (GSourceFunc)request_preview_tick, NULL);
+	}
+}
+
+// The wall clock time the sensor captured the frame at
+static struct timespec get_image_time(const MPImage *image)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (!image->timestamp) {
+		return now;
+	}
 
-	g_main_context_invoke_full(
-		g_main_context_default(),
-		G_PRIORITY_DEFAULT,
-		(GSourceFunc)update_preview,
-		args,
-		free);
+	uint64_t age = mp_trace_now() - image->timestamp;
+	uint64_t nsec = now.tv_sec * 1000000000ull + now.tv_nsec - age;
+	struct timespec captured = {
+		.tv_sec = nsec / 1000000000ull,
+		.tv_nsec = nsec % 1000000000ull,
+	};
+	return captured;
 }
 
-static void process_image_for_capture(const MPImage *image, uint8_t count)
+// What a burst is written with, taken when it starts. Its frames are still
+// written after the capture thread moved on, maybe to the other camera.
+struct burst {
+	char dir[23];
+	// A copy for the metadata, the camera itself for its controls
+	struct camerainfo cam;
+	struct camerainfo *camera;
+};
+
+// Set from starting a burst until it's written and post-processed, a new one
+// can't start before
+static atomic_bool burst_running = false;
+
+// Runs on the burst workers, several frames are written at the same time
+static void process_image_for_capture(const struct burst *burst, const MPImage *image, uint8_t count)
 {
-	static const float neutral[] = {1.0, 1.0, 1.0};
+	const struct camerainfo *cam = &burst->cam;
+
 	static const short cfapatterndim[] = {2, 2};
-	static uint16_t isospeed[] = {0};
+	uint16_t isospeed[] = {0};
 
-	time_t rawtime;
-	time(&rawtime);
-	struct tm tim = *(localtime(&rawtime));
+	struct timespec image_time = get_image_time(image);
+	struct tm tim;
+	localtime_r(&image_time.tv_sec, &tim);
 
 	char datetime[20] = {0};
 	strftime(datetime, 20, "%Y:%m:%d %H:%M:%S", &tim);
+	char subsectime[4] = {0};
+	snprintf(subsectime, 4, "%03ld", image_time.tv_nsec / 1000000);
 
 	char fname[255];
-	sprintf(fname, "%s/%d.dng", burst_dir, count);
-
-	// Get latest exposure and gain now the auto gain/exposure is disabled while capturing
-	gain = v4l2_ctrl_get(current_cam->fd, current_cam->gain_ctrl);
-	exposure = v4l2_ctrl_get(current_cam->fd, V4L2_CID_EXPOSURE);
+	sprintf(fname, "%s/%d.dng", burst->dir, count);
+
+	// The exposure and gain are on the frame for bursts, as they were set when
+	// the burst started with the auto gain/exposure disabled
+	int gain = image->fixed_gain;
+	int exposure = image->fixed_exposure;
+	if (!gain || !exposure) {
+		gain = v4l2_ctrl_get(cam->fd, cam->gain_ctrl);
+		exposure = v4l2_ctrl_get(cam->fd, V4L2_CID_EXPOSURE);
+	}
 
 	TIFF *tif = TIFFOpen(fname, "w");
 	if(!tif) {
@@ -581,15 +855,15 @@ static void process_image_for_capture(const MPImage *image, uint8_t count)
 	char uniquecameramodel[255];
 	sprintf(uniquecameramodel, "%s %s", exif_make, exif_model);
 	TIFFSetField(tif, TIFFTAG_UNIQUECAMERAMODEL, uniquecameramodel);
-	if(current_cam->colormatrix[0]) {
-		TIFFSetField(tif, TIFFTAG_COLORMATRIX1, 9, current_cam->colormatrix);
+	if(cam->colormatrix[0]) {
+		TIFFSetField(tif, TIFFTAG_COLORMATRIX1, 9, cam->colormatrix);
 	} else {
 		TIFFSetField(tif, TIFFTAG_COLORMATRIX1, 9, colormatrix_srgb);
 	}
-	if(current_cam->forwardmatrix[0]) {
-		TIFFSetField(tif, TIFFTAG_FORWARDMATRIX1, 9, current_cam->forwardmatrix);
+	if(cam->forwardmatrix[0]) {
+		TIFFSetField(tif, TIFFTAG_FORWARDMATRIX1, 9, cam->forwardmatrix);
 	}
-	TIFFSetField(tif, TIFFTAG_ASSHOTNEUTRAL, 3, neutral);
+	TIFFSetField(tif, TIFFTAG_ASSHOTNEUTRAL, 3, as_shot_neutral);
 	TIFFSetField(tif, TIFFTAG_CALIBRATIONILLUMINANT1, 21);
 	// Write black thumbnail, only windows uses this
 	{
@@ -601,28 +875,41 @@ static void process_image_for_capture(const MPImage *image, uint8_t count)
 	}
 	TIFFWriteDirectory(tif);
 
-	// Define main photo
+	// Define main photo, deeper formats are stored as 16-bit samples
+	uint32_t bits = mp_pixel_format_bits_per_pixel(image->pixel_format);
 	TIFFSetField(tif, TIFFTAG_SUBFILETYPE, 0);
 	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, image->width);
 	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, image->height);
-	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
+	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, bits > 8 ? 16 : 8);
 	TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_CFA);
 	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
 	TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
 	TIFFSetField(tif, TIFFTAG_CFAREPEATPATTERNDIM, cfapatterndim);
-	TIFFSetField(tif, TIFFTAG_CFAPATTERN, "\002\001\001\000"); // BGGR
-	if(current_cam->whitelevel) {
-		TIFFSetField(tif, TIFFTAG_WHITELEVEL, 1, &current_cam->whitelevel);
+	uint8_t cfapattern[4];
+	quick_debayer_get_cfa_pattern(image->pixel_format, cfapattern);
+	TIFFSetField(tif, TIFFTAG_CFAPATTERN, cfapattern);
+	if(cam->whitelevel) {
+		TIFFSetField(tif, TIFFTAG_WHITELEVEL, 1, &cam->whitelevel);
+	} else if (bits > 8) {
+		// The default would be the full 16 bits
+		uint32_t whitelevel = (1 << bits) - 1;
+		TIFFSetField(tif, TIFFTAG_WHITELEVEL, 1, &whitelevel);
 	}
-	if(current_cam->blacklevel) {
-		TIFFSetField(tif, TIFFTAG_BLACKLEVEL, 1, &current_cam->blacklevel);
+	if(cam->blacklevel) {
+		TIFFSetField(tif, TIFFTAG_BLACKLEVEL, 1, &cam->blacklevel);
 	}
 	TIFFCheckpointDirectory(tif);
 	printf("Writing frame to %s\n", fname);
 
-	unsigned char *pLine = (unsigned char*)malloc(image->width);
+	uint32_t row_bytes = mp_pixel_format_width_to_bytes(image->pixel_format, image->width);
+	uint16_t *pLine = malloc(image->width * sizeof(uint16_t));
 	for(int row = 0; row < image->height; row++){
-		TIFFWriteScanline(tif, image->data + row * image->width, row, 0);
+		if (bits > 8) {
+			mp_pixel_format_unpack_row(image->pixel_format, image->data + row * row_bytes, image->width, pLine);
+			TIFFWriteScanline(tif, pLine, row, 0);
+		} else {
+			TIFFWriteScanline(tif, image->data + row * row_bytes, row, 0);
+		}
 	}
 	free(pLine);
 	TIFFWriteDirectory(tif);
@@ -636,22 +923,24 @@ static void process_image_for_capture(const MPImage *image, uint8_t count)
 		TIFFSetField(tif, EXIFTAG_EXPOSUREPROGRAM, 1);
 	}
 
-	float interval = current_cam->camera_mode.frame_interval.numerator / (float) current_cam->camera_mode.frame_interval.denominator;
+	float interval = cam->camera_mode.frame_interval.numerator / (float) cam->camera_mode.frame_interval.denominator;
 	TIFFSetField(tif, EXIFTAG_EXPOSURETIME, interval / ((float)image->height / (float)exposure));
-	isospeed[0] = (uint16_t)remap(gain - 1, 0, current_cam->gain_max, current_cam->iso_min, current_cam->iso_max);
+	isospeed[0] = (uint16_t)remap(gain - 1, 0, cam->gain_max, cam->iso_min, cam->iso_max);
 	TIFFSetField(tif, EXIFTAG_ISOSPEEDRATINGS, 1, isospeed);
 	TIFFSetField(tif, EXIFTAG_FLASH, 0);
 
 	TIFFSetField(tif, EXIFTAG_DATETIMEORIGINAL, datetime);
 	TIFFSetField(tif, EXIFTAG_DATETIMEDIGITIZED, datetime);
-	if(current_cam->fnumber) {
-		TIFFSetField(tif, EXIFTAG_FNUMBER, current_cam->fnumber);
+	TIFFSetField(tif, EXIFTAG_SUBSECTIMEORIGINAL, subsectime);
+	TIFFSetField(tif, EXIFTAG_SUBSECTIMEDIGITIZED, subsectime);
+	if(cam->fnumber) {
+		TIFFSetField(tif, EXIFTAG_FNUMBER, cam->fnumber);
 	}
-	if(current_cam->focallength) {
-		TIFFSetField(tif, EXIFTAG_FOCALLENGTH, current_cam->focallength);
+	if(cam->focallength) {
+		TIFFSetField(tif, EXIFTAG_FOCALLENGTH, cam->focallength);
 	}
-	if(current_cam->focallength && current_cam->cropfactor) {
-		TIFFSetField(tif, EXIFTAG_FOCALLENGTHIN35MMFILM, (short)(current_cam->focallength * current_cam->cropfactor));
+	if(cam->focallength && cam->cropfactor) {
+		TIFFSetField(tif, EXIFTAG_FOCALLENGTHIN35MMFILM, (short)(cam->focallength * cam->cropfactor));
 	}
 	uint64_t exif_offset = 0;
 	TIFFWriteCustomDirectory(tif, &exif_offset);
@@ -665,7 +954,26 @@ static void process_image_for_capture(const MPImage *image, uint8_t count)
 	TIFFClose(tif);
 }
 
-static void process_capture_burst()
+// Undoes disabling the auto gain/exposure for a burst
+static void restore_auto_exposure(struct camerainfo *camera)
+{
+	if (auto_exposure) {
+		v4l2_ctrl_set(camera->fd, V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_AUTO);
+	}
+	if (auto_gain) {
+		v4l2_ctrl_set(camera->fd, V4L2_CID_AUTOGAIN, 1);
+	}
+}
+
+// Allows the next burst
+static void end_burst(struct burst *burst)
+{
+	restore_auto_exposure(burst->camera);
+	free(burst);
+	atomic_store(&burst_running, false);
+}
+
+static void process_capture_burst(struct burst *burst)
 {
 	time_t rawtime;
 	time(&rawtime);
@@ -679,86 +987,445 @@ static void process_capture_burst()
 
 	// Start post-processing the captured burst
 	char command[1024];
-	g_print("Post process %s to %s.ext\n", burst_dir, fname_target);
-	sprintf(command, "%s %s %s &", processing_script, burst_dir, fname_target);
+	g_print("Post process %s to %s.ext\n", burst->dir, fname_target);
+	sprintf(command, "%s %s %s &", processing_script, burst->dir, fname_target);
 	system(command);
+}
 
-	// Restore the auto exposure and gain if needed
-	if (auto_exposure) {
-		v4l2_ctrl_set(current_cam->fd, V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_AUTO);
+// A burst has to be consecutive sensor frames. Its frames are held on the
+// capture thread until all of them arrived without a gap in their sequence
+// numbers, only then they're written. A gap restarts the burst.
+#define MAX_BURST_RETRIES 3
+// Only every this many frames of a burst are previewed, to leave the CPU to
+// the burst
+#define BURST_PREVIEW_INTERVAL 4
+
+// Only used on the capture thread, burst_frames is NULL while not capturing
+static uint8_t pipeline_capture_burst_size = 0;
+static struct burst *capture_burst = NULL;
+static struct process_image_args *burst_frames = NULL;
+static int burst_frames_collected = 0;
+static int burst_retries = 0;
+
+// Frames the process thread didn't get to before the next one arrived, and
+// frames that couldn't be handed to it at all
+static atomic_size_t pipeline_frames_overwritten = 0;
+static atomic_size_t pipeline_frames_dropped = 0;
+// Frames the driver never handed over, going by the sequence numbers, and
+// frames it marked as corrupted
+static atomic_size_t pipeline_frames_missed = 0;
+static atomic_size_t pipeline_frames_corrupted = 0;
+
+struct process_image_args {
+	MPImage image;
+	// Holds the camera buffer, NULL if the image was copied to the frame pool
+	MPFrame *frame;
+	// Position in the burst, -1 for frames that are only previewed
+	int burst_index;
+	int burst_size;
+	struct burst *burst;
+};
+
+static void release_process_image_args(struct process_image_args *args)
+{
+	if (args->frame) {
+		mp_frame_unref(args->frame);
+	} else {
+		mp_frame_pool_release(frame_pool, args->image.data);
 	}
-	if (auto_gain) {
-		v4l2_ctrl_set(current_cam->fd, V4L2_CID_AUTOGAIN, 1);
+}
+
+// Preview frames go through a triple buffer: the capture thread fills one
+// slot, the mailbox holds another and the process thread reads the third. A
+// frame that wasn't picked up yet is replaced by the next one, so the preview
+// always shows the latest frame. Burst frames go to the burst workers instead,
+// none of them may get lost.
+#define MAILBOX_FRESH 4
+static struct process_image_args preview_slots[3];
+// Slot index, with MAILBOX_FRESH set until the process thread takes it
+static atomic_int preview_mailbox = 0;
+static int preview_write_slot = 1;
+static int preview_read_slot = 2;
+
+static void pipeline_process_preview_image(MPPipeline *pipeline, void *data)
+{
+	// Every fresh frame is announced once, replacing one isn't
+	if (!(atomic_load(&preview_mailbox) & MAILBOX_FRESH)) {
+		return;
+	}
+
+	preview_read_slot = atomic_exchange(&preview_mailbox, preview_read_slot) & ~MAILBOX_FRESH;
+	struct process_image_args *args = &preview_slots[preview_read_slot];
+
+	process_image_for_preview(&args->image, false);
+	release_process_image_args(args);
+}
+
+// Only called on the capture thread
+static void publish_preview_image(struct process_image_args *args)
+{
+	preview_slots[preview_write_slot] = *args;
+	int previous = atomic_exchange(&preview_mailbox, preview_write_slot | MAILBOX_FRESH);
+	preview_write_slot = previous & ~MAILBOX_FRESH;
+
+	if (previous & MAILBOX_FRESH) {
+		release_process_image_args(&preview_slots[preview_write_slot]);
+		atomic_fetch_add(&pipeline_frames_overwritten, 1);
+	} else {
+		mp_pipeline_invoke(process_pipeline, pipeline_process_preview_image, NULL, 0);
 	}
 }
 
-static volatile size_t pipeline_frames_received = 0;
-static volatile size_t pipeline_frames_processed = 0;
-static volatile uint8_t pipeline_capture_frames = 0;
-static volatile uint8_t pipeline_capture_burst_size = 0;
+static void pipeline_write_burst_image(MPPipeline *pipeline, struct process_image_args *args)
+{
+	uint64_t trace_start = mp_trace_begin();
+	process_image_for_capture(args->burst, &args->image, args->burst_index);
+	mp_trace_end(MP_TRACE_BURST_WRITE, args->image.sequence, trace_start);
+}
 
-static void pipeline_process_image(MPPipeline *pipeline, MPImage *image)
+static void pipeline_finish_burst(MPPipeline *pipeline, struct process_image_args *args)
 {
-	bool update_thumbnail = false;
+	process_capture_burst(args->burst);
+	process_image_for_preview(&args->image, true);
+	release_process_image_args(args);
+	end_burst(args->burst);
+}
 
-	if (pipeline_capture_frames > 0) {
-		uint8_t count = pipeline_capture_burst_size - pipeline_capture_frames;
-		--pipeline_capture_frames;
+// Called in burst order once a frame is written
+static void pipeline_burst_image_written(MPPipeline *pipeline, struct process_image_args *args)
+{
+	if (args->burst_index == args->burst_size - 1) {
+		mp_pipeline_invoke(process_pipeline, (MPPipelineCallback)pipeline_finish_burst, args, sizeof(struct process_image_args));
+	} else {
+		release_process_image_args(args);
+	}
+}
+
+static bool get_process_image_args(MPFrame *frame, struct process_image_args *args)
+{
+	args->image = *mp_frame_get_image(frame);
+	args->frame = NULL;
+
+	if (mp_pipeline_capture_get_num_queued_buffers(pipeline_capture) >= MIN_QUEUED_BUFFERS) {
+		args->frame = mp_frame_ref(frame);
+		return true;
+	}
+
+	// Copy from the camera buffer, so it can be queued again right away
+	uint8_t *buffer = mp_frame_pool_acquire(frame_pool);
+	if (!buffer) {
+		return false;
+	}
 
-		process_image_for_capture(image, count);
+	uint64_t trace_start = mp_trace_begin();
+	size_t size = mp_pixel_format_width_to_bytes(args->image.pixel_format, args->image.width) * args->image.height;
+	assert(size <= mp_frame_pool_get_size(frame_pool));
+	memcpy(buffer, args->image.data, size);
+	mp_trace_end(MP_TRACE_COPY, args->image.sequence, trace_start);
 
-		if (pipeline_capture_frames == 0) {
-			process_capture_burst();
-			update_thumbnail = true;
+	args->image.data = buffer;
+	return true;
+}
+
+static void release_burst_frames()
+{
+	for (int i = 0; i < burst_frames_collected; ++i) {
+		release_process_image_args(&burst_frames[i]);
+	}
+	burst_frames_collected = 0;
+}
+
+static void pipeline_cancel_burst(MPPipeline *pipeline, void *data)
+{
+	if (!burst_frames) {
+		return;
+	}
+
+	release_burst_frames();
+	free(burst_frames);
+	burst_frames = NULL;
+
+	mp_camera_set_fixed_exposure(current_cam->camera, 0, 0);
+	end_burst(capture_burst);
+	capture_burst = NULL;
+}
+
+static void collect_burst_frame(struct process_image_args *args)
+{
+	if (burst_frames_collected > 0) {
+		uint32_t expected = burst_frames[burst_frames_collected - 1].image.sequence + 1;
+		if (args->image.sequence != expected) {
+			if (burst_retries < MAX_BURST_RETRIES) {
+				printf("Burst missed frames %u to %u, restarting it\n", expected, args->image.sequence - 1);
+				++burst_retries;
+				release_burst_frames();
+			} else {
+				printf("Burst missed frames %u to %u\n", expected, args->image.sequence - 1);
+			}
 		}
 	}
 
-	process_image_for_preview(image, update_thumbnail);
+	args->burst_index = burst_frames_collected;
+	args->burst_size = pipeline_capture_burst_size;
+	args->burst = capture_burst;
+	burst_frames[burst_frames_collected++] = *args;
 
-	free(image->data);
+	if (burst_frames_collected < pipeline_capture_burst_size) {
+		return;
+	}
+
+	for (int i = 0; i < burst_frames_collected; ++i) {
+		mp_pipeline_invoke_ordered(burst_pipeline, (MPPipelineCallback)pipeline_write_burst_image, (MPPipelineCallback)pipeline_burst_image_written, &burst_frames[i], sizeof(struct process_image_args));
+	}
 
-	++pipeline_frames_processed;
+	free(burst_frames);
+	burst_frames = NULL;
+	capture_burst = NULL;
+
+	// The auto gain/exposure is restored once the burst is written
+	mp_camera_set_fixed_exposure(current_cam->camera, 0, 0);
 }
 
-static void pipeline_on_frame_received(MPImage image, void *data)
+static void pipeline_on_frame_received(MPFrame *frame, void *data)
 {
-	// If we haven't processed the previous frame yet, drop this one
-	if (pipeline_frames_processed != pipeline_frames_received
-		&& pipeline_capture_frames == 0)
-	{
-		printf("Dropped frame\n");
+	static uint32_t last_sequence = 0;
+
+	struct process_image_args args = {
+		.burst_index = -1,
+	};
+
+	const MPImage *image = mp_frame_get_image(frame);
+	if (!switch_start && image->sequence > last_sequence + 1) {
+		atomic_fetch_add(&pipeline_frames_missed, image->sequence - last_sequence - 1);
+	}
+	last_sequence = image->sequence;
+
+	if (image->flags & V4L2_BUF_FLAG_ERROR) {
+		atomic_fetch_add(&pipeline_frames_corrupted, 1);
+		return;
+	}
+
+	if (switch_start) {
+		uint64_t now = mp_trace_now();
+		printf("First frame %.1f ms after switching the camera\n", (now - switch_start) / 1000000.0);
+		if (mp_trace_enabled) {
+			mp_trace_record(MP_TRACE_CAMERA_SWITCH, image->sequence, switch_start, now);
+		}
+		switch_start = 0;
+	}
+
+	if (!get_process_image_args(frame, &args)) {
+		printf("Dropped frame, no free buffers\n");
+		atomic_fetch_add(&pipeline_frames_dropped, 1);
+		return;
+	}
+
+	if (burst_frames) {
+		// Keep the preview going at a lower rate, unless the frame had to be
+		// copied
+		if (args.frame && burst_frames_collected % BURST_PREVIEW_INTERVAL == 0) {
+			struct process_image_args preview = args;
+			preview.frame = mp_frame_ref(args.frame);
+			publish_preview_image(&preview);
+		}
+
+		collect_burst_frame(&args);
 		return;
 	}
 
-	// TODO: If the last image hasn't been processed yet we should drop this one
+	publish_preview_image(&args);
+}
+
+// The driver always needs MIN_QUEUED_BUFFERS, or enough to last a stall of the
+// capture thread, on top of the ones the preview holds
+static uint32_t get_num_required_buffers(const MPCameraMode *mode)
+{
+	uint32_t stall_frames = MIN_QUEUED_BUFFERS;
+	if (mode->frame_interval.numerator > 0) {
+		uint32_t period_ms = 1000 * mode->frame_interval.numerator;
+		stall_frames = (MAX_CAPTURE_STALL_MS * mode->frame_interval.denominator + period_ms - 1) / period_ms;
+	}
+
+	return MAX(MIN_QUEUED_BUFFERS, stall_frames) + PREVIEW_DEPTH;
+}
+
+// A burst can be taken without copies if its frames fit in the budget too. The
+// budget covers the preview copies as well.
+static uint32_t get_num_capture_buffers(const struct camerainfo *info, const MPCameraMode *mode)
+{
+	if (info->num_buffers > 0) {
+		return MIN(info->num_buffers, MP_CAMERA_MAX_BUFFERS);
+	}
+
+	size_t frame_size = mp_pixel_format_width_to_bytes(mode->pixel_format, mode->width) * mode->height;
 
-	// Copy from the camera buffer
-	size_t size = mp_pixel_format_bytes_per_pixel(image.pixel_format) * image.width * image.height;
-	uint8_t *buffer = malloc(size);
-	memcpy(buffer, image.data, size);
+	uint32_t required = get_num_required_buffers(mode);
+	uint32_t wanted = required + burst_length;
+	size_t affordable = buffer_budget / frame_size;
+	affordable = affordable > PREVIEW_COPIES ? affordable - PREVIEW_COPIES : 0;
 
-	image.data = buffer;
+	uint32_t count = MIN(wanted, affordable);
+	if (count < required) {
+		g_printerr("A buffer budget of %zu MiB only fits %zu frames of %ux%u next to the copies, using %u\n",
+			buffer_budget / (1024 * 1024), affordable, mode->width, mode->height, required);
+		count = required;
+	}
+	return MIN(count, MP_CAMERA_MAX_BUFFERS);
+}
+
+// The frames of a burst that don't fit in the capture buffers are copied
+static uint32_t get_num_copy_buffers(const MPCameraMode *mode, uint32_t num_buffers)
+{
+	uint32_t required = get_num_required_buffers(mode);
+	uint32_t spare = num_buffers > required ? num_buffers - required : 0;
+	return PREVIEW_COPIES + (spare < burst_length ? burst_length - spare : 0);
+}
+
+static void acquire_capture_buffers(struct camerainfo *info, uint32_t count, size_t size)
+{
+	if (info->capture_pool && count != mp_frame_pool_get_count(info->capture_pool)) {
+		mp_frame_pool_free(info->capture_pool);
+		info->capture_pool = NULL;
+	}
+	if (!info->capture_pool) {
+		info->capture_pool = mp_frame_pool_new(count);
+	}
+	// Doesn't allocate again when switching back to the camera
+	mp_frame_pool_set_size(info->capture_pool, size);
 
-	++pipeline_frames_received;
+	while (num_capture_buffers < count) {
+		uint8_t *data = mp_frame_pool_acquire(info->capture_pool);
+		assert(data);
 
-	mp_pipeline_invoke(process_pipeline, (MPPipelineCallback)pipeline_process_image, &image, sizeof(MPImage));
+		MPCameraBuffer *buffer = &capture_buffers[num_capture_buffers++];
+		buffer->data = data;
+		buffer->length = size;
+		buffer->fd = mp_frame_pool_get_fd(info->capture_pool, data);
+	}
+}
+
+static void release_capture_buffers(struct camerainfo *info)
+{
+	for (uint32_t i = 0; i < num_capture_buffers; ++i) {
+		mp_frame_pool_release(info->capture_pool, capture_buffers[i].data);
+	}
+	num_capture_buffers = 0;
+}
+
+// Its buffers have to be released first
+static void free_capture_pool(struct camerainfo *info)
+{
+	if (info->capture_pool) {
+		mp_frame_pool_free(info->capture_pool);
+		info->capture_pool = NULL;
+	}
+}
+
+// For the format the driver settled on, which decides how deep the levels are
+static void init_preview_lut(struct camerainfo *info, MPPixelFormat format)
+{
+	// The preview only sees the top 8 bits of deeper formats
+	int bits = mp_pixel_format_bits_per_pixel(format);
+	if (bits == info->preview_lut_bits) {
+		return;
+	}
+	info->preview_lut_bits = bits;
+
+	int shift = bits > 8 ? bits - 8 : 0;
+	int blacklevel = info->blacklevel >> shift;
+	int whitelevel = info->whitelevel >> shift;
+
+	// The preview shows the frames with the same white balance as the DNG
+	float gains[3];
+	for (int i = 0; i < 3; ++i) {
+		gains[i] = 1.0f / as_shot_neutral[i];
+	}
+
+	if (info->preview_matrix) {
+		float matrix[9];
+		for (int row = 0; row < 3; ++row) {
+			for (int col = 0; col < 3; ++col) {
+				matrix[row * 3 + col] = 0;
+				for (int i = 0; i < 3; ++i) {
+					matrix[row * 3 + col] += xyz_d50_to_srgb[row * 3 + i] * info->forwardmatrix[i * 3 + col];
+				}
+			}
+		}
+		quick_debayer_lut_init_matrix(&info->preview_lut, blacklevel, whitelevel, gains, matrix);
+	} else {
+		quick_debayer_lut_init(&info->preview_lut, blacklevel, whitelevel, gains);
+	}
 }
 
 static void pipeline_swap_camera(MPPipeline *p, struct camerainfo **_info)
 {
 	struct camerainfo *info = *_info;
 
+	switch_start = mp_trace_now();
+
+	// Ending the capture waits for every frame to be released
+	pipeline_cancel_burst(p, NULL);
+
 	if (pipeline_capture) {
 		mp_pipeline_capture_end(pipeline_capture);
 	}
+	if (current_cam) {
+		release_capture_buffers(current_cam);
+	}
 
 	struct camerainfo *other = info == &front_cam ? &rear_cam : &front_cam;
 
 	mp_device_setup_link(device, other->pad_id, interface_pad_id, false);
 	mp_device_setup_link(device, info->pad_id, interface_pad_id, true);
 
+	// The sensor already has its mode unless it changed
 	mp_camera_set_mode(info->camera, &info->camera_mode);
-	pipeline_capture = mp_pipeline_capture_start(capture_pipeline, info->camera, pipeline_on_frame_received, NULL);
+
+	const MPCameraMode *mode = mp_camera_get_mode(info->camera);
+	init_preview_lut(info, mode->pixel_format);
+
+	size_t frame_size = mp_pixel_format_width_to_bytes(mode->pixel_format, mode->width) * mode->height;
+	uint32_t num_buffers = get_num_capture_buffers(info, mode);
+	uint32_t num_copies = get_num_copy_buffers(mode, num_buffers);
+
+	// Only reallocates if the frame size or number of copies changed
+	mp_frame_pool_set_limit(frame_pool, num_copies);
+	mp_frame_pool_set_size(frame_pool, frame_size);
+
+	// The buffers kept for switching back to the other camera count against
+	// the budget as well, they go when this one needs the memory
+	size_t memory = (num_buffers + num_copies) * frame_size;
+	size_t other_memory = 0;
+	if (other->capture_pool) {
+		other_memory = mp_frame_pool_get_count(other->capture_pool) * mp_frame_pool_get_size(other->capture_pool);
+		if (memory + other_memory > buffer_budget) {
+			free_capture_pool(other);
+			other_memory = 0;
+		}
+	}
+	if (info->driver_buffers) {
+		pipeline_capture = mp_pipeline_capture_start(capture_pipeline, info->camera, NULL, num_buffers, pipeline_on_frame_received, NULL);
+	} else {
+		acquire_capture_buffers(info, num_buffers, frame_size);
+		pipeline_capture = mp_pipeline_capture_start(capture_pipeline, info->camera, capture_buffers, num_capture_buffers, pipeline_on_frame_received, NULL);
+
+		// Don't try again for this camera
+		if (mp_camera_get_memory(info->camera) == MP_CAMERA_MEMORY_MMAP) {
+			info->driver_buffers = true;
+			release_capture_buffers(info);
+			free_capture_pool(info);
+		}
+	}
+
+	static const char *memory_names[] = { "driver", "user pointer", "DMABUF" };
+	uint32_t num_capture = mp_camera_get_num_buffers(info->camera);
+	printf("Capturing %ux%u %s into %u %s buffers, %.1f MiB, %u buffers for copies, %.1f MiB, and keeping %.1f MiB for the other camera\n",
+		mode->width, mode->height, mp_pixel_format_to_str(mode->pixel_format),
+		num_capture, memory_names[mp_camera_get_memory(info->camera)],
+		num_capture * frame_size / (1024.0 * 1024.0),
+		num_copies,
+		num_copies * frame_size / (1024.0 * 1024.0),
+		other_memory / (1024.0 * 1024.0));
 
 	current_cam = info;
 }
@@ -790,6 +1457,11 @@ static void pipeline_setup_camera(struct camerainfo *info)
 
 	info->camera = mp_camera_new(video_fd, info->fd);
 
+	if (info->preview_matrix && !info->forwardmatrix[0]) {
+		g_printerr("preview-matrix needs a forwardmatrix for %s\n", info->dev_name);
+		info->preview_matrix = 0;
+	}
+
 	// Trigger continuous auto focus if the sensor supports it
 	if (v4l2_has_control(info->fd, V4L2_CID_FOCUS_AUTO)) {
 		info->has_af_c = 1;
@@ -842,6 +1514,11 @@ static void pipeline_setup(MPPipeline *pipeline, void *data)
 	pipeline_setup_camera(&front_cam);
 	pipeline_setup_camera(&rear_cam);
 
+	// Both sensors keep their mode, so switching only has to set the video
+	// device
+	mp_camera_prepare_mode(front_cam.camera, &front_cam.camera_mode);
+	mp_camera_prepare_mode(rear_cam.camera, &rear_cam.camera_mode);
+
 	struct camerainfo *next = &rear_cam;
 	pipeline_swap_camera(pipeline, &next);
 }
@@ -850,6 +1527,14 @@ void start_pipeline()
 {
 	capture_pipeline = mp_pipeline_new();
 	process_pipeline = mp_pipeline_new();
+	burst_pipeline = mp_pipeline_new_workers(0);
+	frame_pool = mp_frame_pool_new(burst_length + PREVIEW_COPIES);
+	debayer_pool = quick_debayer_pool_new(0);
+
+	// Falls back to what is permitted, which is logged
+	mp_pipeline_set_schedule(capture_pipeline, &capture_schedule);
+	mp_pipeline_set_schedule(process_pipeline, &process_schedule);
+	mp_pipeline_set_schedule(burst_pipeline, &burst_schedule);
 
 	mp_pipeline_invoke(capture_pipeline, pipeline_setup, NULL, 0);
 
@@ -858,29 +1543,90 @@ void start_pipeline()
 	draw_controls();
 }
 
-void stop_pipeline()
+static void pipeline_stop_capture(MPPipeline *pipeline, void *data)
 {
+	pipeline_cancel_burst(pipeline, NULL);
+
 	if (pipeline_capture) {
 		mp_pipeline_capture_end(pipeline_capture);
+		pipeline_capture = NULL;
 	}
+}
+
+void stop_pipeline()
+{
+	// Ending the capture waits for the burst workers and the process thread to
+	// release their frames, so it has to finish before any pipeline is freed
+	mp_pipeline_invoke(capture_pipeline, pipeline_stop_capture, NULL, 0);
+	mp_pipeline_sync(capture_pipeline);
 
 	mp_pipeline_free(capture_pipeline);
+	mp_pipeline_free(burst_pipeline);
 	mp_pipeline_free(process_pipeline);
+	quick_debayer_pool_free(debayer_pool);
+
+	MPFramePoolStats stats;
+	mp_frame_pool_get_stats(frame_pool, &stats);
+	printf("Frame pool: %zu buffers used at most, %zu times exhausted\n", stats.high_water_mark, stats.exhausted);
+	printf("Frames: %zu replaced before being previewed, %zu dropped, %zu missed, %zu corrupted\n",
+		atomic_load(&pipeline_frames_overwritten),
+		atomic_load(&pipeline_frames_dropped),
+		atomic_load(&pipeline_frames_missed),
+		atomic_load(&pipeline_frames_corrupted));
+	mp_frame_pool_free(frame_pool);
+	if (current_cam) {
+		release_capture_buffers(current_cam);
+	}
+	free_capture_pool(&front_cam);
+	free_capture_pool(&rear_cam);
+	struct update_preview_args *pending = atomic_exchange(&pending_preview, NULL);
+	if (pending) {
+		free_update_preview_args(pending);
+	}
+	free_preview_images();
 }
 
 static void pipeline_start_capture_impl(MPPipeline *pipeline, uint32_t *count)
 {
-	pipeline_capture_frames = *count;
+	if (*count == 0) {
+		return;
+	}
+	if (atomic_exchange(&burst_running, true)) {
+		printf("Still writing the last burst, not starting another one\n");
+		return;
+	}
+
+	struct burst *burst = malloc(sizeof(struct burst));
+	strcpy(burst->dir, "/tmp/megapixels.XXXXXX");
+	if (!mkdtemp(burst->dir)) {
+		g_printerr("Could not make capture directory %s\n", burst->dir);
+		free(burst);
+		atomic_store(&burst_running, false);
+		return;
+	}
+	burst->cam = *current_cam;
+	burst->camera = current_cam;
+	capture_burst = burst;
+
 	pipeline_capture_burst_size = *count;
+	burst_frames = malloc(sizeof(struct process_image_args) * *count);
+	burst_frames_collected = 0;
+	burst_retries = 0;
 
 	// Disable the autogain/exposure while taking the burst
 	v4l2_ctrl_set(current_cam->fd, V4L2_CID_AUTOGAIN, 0);
 	v4l2_ctrl_set(current_cam->fd, V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_MANUAL);
+
+	// They stay like this for the whole burst, so they're only read once
+	// instead of for every frame
+	mp_camera_set_fixed_exposure(current_cam->camera,
+		v4l2_ctrl_get(current_cam->fd, V4L2_CID_EXPOSURE),
+		v4l2_ctrl_get(current_cam->fd, current_cam->gain_ctrl));
 }
 
 void pipeline_start_capture(uint32_t count)
 {
-	mp_pipeline_invoke(process_pipeline, (MPPipelineCallback)pipeline_start_capture_impl, &count, sizeof(uint32_t));
+	mp_pipeline_invoke(capture_pipeline, (MPPipelineCallback)pipeline_start_capture_impl, &count, sizeof(uint32_t));
 }
 
 void
@@ -912,17 +1658,11 @@ on_open_directory_clicked(GtkWidget *widget, gpointer user_data)
 void
 on_shutter_clicked(GtkWidget *widget, gpointer user_data)
 {
-	char template[] = "/tmp/megapixels.XXXXXX";
-	char *tempdir;
-	tempdir = mkdtemp(template);
-
-	if (tempdir == NULL) {
-		g_printerr("Could not make capture directory %s\n", template);
-		exit (EXIT_FAILURE);
+	// Checked again when the burst starts
+	if (atomic_load(&burst_running)) {
+		return;
 	}
 
-	strcpy(burst_dir, tempdir);
-
 	pipeline_start_capture(burst_length);
 }
 
@@ -1185,6 +1925,7 @@ main(int argc, char *argv[])
 	TIFFSetTagExtender(register_custom_tiff_tags);
 
 	gtk_init(&argc, &argv);
+	mp_trace_init();
 	g_object_set(gtk_settings_get_default(), "gtk-application-prefer-dark-theme", TRUE, NULL);
 	GtkBuilder *builder = gtk_builder_new_from_resource("/org/postmarketos/Megapixels/camera.glade");
 
@@ -1215,6 +1956,9 @@ main(int argc, char *argv[])
 	g_signal_connect(open_directory, "clicked", G_CALLBACK(on_open_directory_clicked), NULL);
 	g_signal_connect(preview, "draw", G_CALLBACK(preview_draw), NULL);
 	g_signal_connect(preview, "configure-event", G_CALLBACK(preview_configure), NULL);
+	g_signal_connect(preview, "map", G_CALLBACK(on_preview_map_changed), NULL);
+	g_signal_connect(preview, "unmap", G_CALLBACK(on_preview_map_changed), NULL);
+	g_signal_connect(window, "window-state-event", G_CALLBACK(on_window_state_changed), NULL);
 	gtk_widget_set_events(preview, gtk_widget_get_events(preview) |
 			GDK_BUTTON_PRESS_MASK | GDK_POINTER_MOTION_MASK);
 	g_signal_connect(preview, "button-press-event", G_CALLBACK(on_preview_tap), NULL);
@@ -1253,6 +1997,7 @@ main(int argc, char *argv[])
 	gtk_main();
 
 	stop_pipeline();
+	mp_trace_dump();
 
 	return 0;
 }
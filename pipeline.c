@@ -1,28 +1,185 @@
+// For the affinity of the threads
+#define _GNU_SOURCE
+
 #include "pipeline.h"
+#include "trace.h"
 
 #include <gtk/gtk.h>
 #include <glib-unix.h>
 #include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Every thread that invokes on a pipeline gets its own single producer, single
+// consumer ring of messages, so invoking doesn't take locks or allocate.
+#define RING_SLOTS 256
+#define SLOT_PAYLOAD 48
+
+struct slot {
+    MPPipelineCallback callback;
+    // Payloads larger than SLOT_PAYLOAD are copied to the heap and the slot
+    // holds a pointer to them
+    size_t size;
+    _Alignas(16) uint8_t data[SLOT_PAYLOAD];
+};
+
+// Messages that didn't fit in a full ring
+struct overflow {
+    struct overflow *next;
+    MPPipelineCallback callback;
+    size_t size;
+    _Alignas(16) uint8_t data[];
+};
+
+struct ring {
+    pthread_t producer;
+    // Rings are only ever added, to the front of the list
+    struct ring *next;
+
+    // Only written by the producer, which also keeps the last tail it saw to
+    // not touch the consumer's cache line on every message
+    _Alignas(64) atomic_size_t head;
+    size_t cached_tail;
+
+    // Only written by the consumer
+    _Alignas(64) atomic_size_t tail;
+
+    // Once the ring was full every message goes to the overflow list, until
+    // the consumer has taken it. Waiting for room instead would deadlock two
+    // pipelines that invoke each other.
+    pthread_mutex_t overflow_lock;
+    atomic_bool overflowed;
+    struct overflow *overflow_head;
+    struct overflow *overflow_tail;
+
+    struct slot slots[RING_SLOTS];
+};
+
+struct workers;
 
 struct _MPPipeline {
+    // Set for pipelines that run on a pool of workers, the rest is unused then
+    struct workers *workers;
+
     GMainContext *main_context;
     GMainLoop *main_loop;
     pthread_t thread;
+    // Set once the thread runs, scheduling is changed through it
+    atomic_int tid;
+
+    // Rings are only ever added, under the lock
+    pthread_mutex_t rings_lock;
+    struct ring *_Atomic rings;
+
+    // The consumer is only woken once until it has drained the rings again
+    int wakeup_fd;
+    atomic_bool wakeup_pending;
+    GSource *wakeup_source;
 };
 
 static void *thread_main_loop(void *arg)
 {
     MPPipeline *pipeline = arg;
 
+    atomic_store(&pipeline->tid, syscall(SYS_gettid));
+
     g_main_loop_run(pipeline->main_loop);
     return NULL;
 }
 
+static void run_slot(MPPipeline *pipeline, struct slot *slot)
+{
+    if (slot->size > SLOT_PAYLOAD) {
+        void *data = *(void **)slot->data;
+        slot->callback(pipeline, data);
+        free(data);
+    } else {
+        slot->callback(pipeline, slot->data);
+    }
+}
+
+// Runs the messages up to head, or all of them for SIZE_MAX. Every message is
+// taken off the ring before it runs, as it may invoke again.
+static void run_ring(MPPipeline *pipeline, struct ring *ring, size_t head)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (tail != head && tail != atomic_load_explicit(&ring->head, memory_order_acquire)) {
+        struct slot slot = ring->slots[tail % RING_SLOTS];
+        atomic_store_explicit(&ring->tail, ++tail, memory_order_release);
+
+        run_slot(pipeline, &slot);
+
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    }
+}
+
+static bool on_wakeup(int fd, GIOCondition condition, MPPipeline *pipeline)
+{
+    atomic_store(&pipeline->wakeup_pending, false);
+
+    uint64_t count;
+    if (read(fd, &count, sizeof(uint64_t)) == -1 && errno != EAGAIN) {
+        g_printerr("MPPipeline: eventfd read error %d, %s\n", errno, strerror(errno));
+    }
+
+    for (struct ring *ring = atomic_load(&pipeline->rings); ring; ring = ring->next) {
+        run_ring(pipeline, ring, SIZE_MAX);
+
+        while (atomic_load(&ring->overflowed)) {
+            pthread_mutex_lock(&ring->overflow_lock);
+            struct overflow *overflow = ring->overflow_head;
+            ring->overflow_head = NULL;
+            ring->overflow_tail = NULL;
+            atomic_store(&ring->overflowed, false);
+            // Everything in the ring now came before the overflow
+            size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            pthread_mutex_unlock(&ring->overflow_lock);
+
+            run_ring(pipeline, ring, head);
+
+            while (overflow) {
+                struct overflow *next = overflow->next;
+                overflow->callback(pipeline, overflow->data);
+                free(overflow);
+                overflow = next;
+            }
+
+            run_ring(pipeline, ring, SIZE_MAX);
+        }
+    }
+
+    return true;
+}
+
 MPPipeline *mp_pipeline_new()
 {
     MPPipeline *pipeline = malloc(sizeof(MPPipeline));
+    pipeline->workers = NULL;
     pipeline->main_context = g_main_context_new();
     pipeline->main_loop = g_main_loop_new(pipeline->main_context, false);
+    atomic_init(&pipeline->tid, 0);
+
+    pthread_mutex_init(&pipeline->rings_lock, NULL);
+    atomic_init(&pipeline->rings, NULL);
+
+    pipeline->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(pipeline->wakeup_fd != -1);
+    atomic_init(&pipeline->wakeup_pending, false);
+    pipeline->wakeup_source = g_unix_fd_source_new(pipeline->wakeup_fd, G_IO_IN);
+    g_source_set_callback(
+        pipeline->wakeup_source,
+        (GSourceFunc)on_wakeup,
+        pipeline,
+        NULL);
+    g_source_attach(pipeline->wakeup_source, pipeline->main_context);
+
     int res = pthread_create(
         &pipeline->thread, NULL, thread_main_loop, pipeline);
     assert(res == 0);
@@ -30,41 +187,181 @@ MPPipeline *mp_pipeline_new()
     return pipeline;
 }
 
-struct invoke_args {
-    MPPipeline *pipeline;
-    void (*callback)(MPPipeline *, void *);
-};
+static struct ring *get_ring(MPPipeline *pipeline)
+{
+    pthread_t self = pthread_self();
+
+    for (struct ring *ring = atomic_load(&pipeline->rings); ring; ring = ring->next) {
+        if (pthread_equal(ring->producer, self)) {
+            return ring;
+        }
+    }
+
+    // First message from this thread, only it adds its ring
+    struct ring *ring = aligned_alloc(64, sizeof(struct ring));
+    ring->producer = self;
+    atomic_init(&ring->head, 0);
+    ring->cached_tail = 0;
+    atomic_init(&ring->tail, 0);
+    pthread_mutex_init(&ring->overflow_lock, NULL);
+    atomic_init(&ring->overflowed, false);
+    ring->overflow_head = NULL;
+    ring->overflow_tail = NULL;
+
+    pthread_mutex_lock(&pipeline->rings_lock);
+    ring->next = atomic_load(&pipeline->rings);
+    atomic_store(&pipeline->rings, ring);
+    pthread_mutex_unlock(&pipeline->rings_lock);
+
+    return ring;
+}
+
+static void free_ring(struct ring *ring)
+{
+    // Messages that never ran
+    for (size_t tail = atomic_load(&ring->tail); tail != atomic_load(&ring->head); ++tail) {
+        struct slot *slot = &ring->slots[tail % RING_SLOTS];
+        if (slot->size > SLOT_PAYLOAD) {
+            free(*(void **)slot->data);
+        }
+    }
+    while (ring->overflow_head) {
+        struct overflow *next = ring->overflow_head->next;
+        free(ring->overflow_head);
+        ring->overflow_head = next;
+    }
+
+    pthread_mutex_destroy(&ring->overflow_lock);
+    free(ring);
+}
+
+static bool ring_is_full(struct ring *ring, size_t head)
+{
+    if (head - ring->cached_tail < RING_SLOTS) {
+        return false;
+    }
+    ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return head - ring->cached_tail == RING_SLOTS;
+}
 
-static bool invoke_impl(struct invoke_args *args)
+static void wake(MPPipeline *pipeline)
 {
-    args->callback(args->pipeline, args + 1);
-    return false;
+    if (!atomic_exchange(&pipeline->wakeup_pending, true)) {
+        uint64_t count = 1;
+        if (write(pipeline->wakeup_fd, &count, sizeof(uint64_t)) == -1) {
+            g_printerr("MPPipeline: eventfd write error %d, %s\n", errno, strerror(errno));
+        }
+    }
 }
 
+static void workers_invoke(MPPipeline *pipeline, MPPipelineCallback callback, MPPipelineCallback complete, void *data, size_t size);
+
 void mp_pipeline_invoke(MPPipeline *pipeline, MPPipelineCallback callback, void *data, size_t size)
 {
-    if (pthread_self() != pipeline->thread) {
-        struct invoke_args *args = malloc(sizeof(struct invoke_args) + size);
-        args->pipeline = pipeline;
-        args->callback = callback;
+    if (pipeline->workers) {
+        workers_invoke(pipeline, callback, NULL, data, size);
+        return;
+    }
+
+    if (pthread_self() == pipeline->thread) {
+        callback(pipeline, data);
+        return;
+    }
 
+    struct ring *ring = get_ring(pipeline);
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (atomic_load(&ring->overflowed) || ring_is_full(ring, head)) {
+        struct overflow *overflow = malloc(sizeof(struct overflow) + size);
+        overflow->next = NULL;
+        overflow->callback = callback;
+        overflow->size = size;
         if (size > 0) {
-            memcpy(args + 1, data, size);
+            memcpy(overflow->data, data, size);
         }
 
-        g_main_context_invoke_full(
-            pipeline->main_context,
-            G_PRIORITY_DEFAULT,
-            (GSourceFunc)invoke_impl,
-            args,
-            free);
-    } else {
-        callback(pipeline, data);
+        pthread_mutex_lock(&ring->overflow_lock);
+        if (ring->overflow_tail) {
+            ring->overflow_tail->next = overflow;
+        } else {
+            ring->overflow_head = overflow;
+        }
+        ring->overflow_tail = overflow;
+        atomic_store(&ring->overflowed, true);
+        pthread_mutex_unlock(&ring->overflow_lock);
+
+        wake(pipeline);
+        return;
     }
+
+    struct slot *slot = &ring->slots[head % RING_SLOTS];
+    slot->callback = callback;
+    slot->size = size;
+    if (size > SLOT_PAYLOAD) {
+        void *copy = malloc(size);
+        memcpy(copy, data, size);
+        *(void **)slot->data = copy;
+    } else if (size > 0) {
+        memcpy(slot->data, data, size);
+    }
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    wake(pipeline);
+}
+
+struct sync {
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    bool done;
+};
+
+static void sync_impl(MPPipeline *pipeline, struct sync **_sync)
+{
+    struct sync *sync = *_sync;
+
+    pthread_mutex_lock(&sync->lock);
+    sync->done = true;
+    pthread_cond_signal(&sync->done_cond);
+    pthread_mutex_unlock(&sync->lock);
 }
 
+void mp_pipeline_sync(MPPipeline *pipeline)
+{
+    assert(!pipeline->workers);
+
+    if (pthread_self() == pipeline->thread) {
+        return;
+    }
+
+    struct sync sync = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .done_cond = PTHREAD_COND_INITIALIZER,
+        .done = false,
+    };
+    struct sync *sync_ptr = &sync;
+    mp_pipeline_invoke(pipeline, (MPPipelineCallback)sync_impl, &sync_ptr, sizeof(struct sync *));
+
+    pthread_mutex_lock(&sync.lock);
+    while (!sync.done) {
+        pthread_cond_wait(&sync.done_cond, &sync.lock);
+    }
+    pthread_mutex_unlock(&sync.lock);
+
+    pthread_cond_destroy(&sync.done_cond);
+    pthread_mutex_destroy(&sync.lock);
+}
+
+static void workers_free(struct workers *workers);
+
 void mp_pipeline_free(MPPipeline *pipeline)
 {
+    if (pipeline->workers) {
+        workers_free(pipeline->workers);
+        free(pipeline);
+        return;
+    }
+
     g_main_loop_quit(pipeline->main_loop);
 
     // Force the main thread loop to wake up, otherwise we might not exit
@@ -72,21 +369,616 @@ void mp_pipeline_free(MPPipeline *pipeline)
 
     void *r;
     pthread_join(pipeline->thread, &r);
+
+    struct ring *ring = atomic_load(&pipeline->rings);
+    while (ring) {
+        struct ring *next = ring->next;
+        free_ring(ring);
+        ring = next;
+    }
+
+    g_source_destroy(pipeline->wakeup_source);
+    g_source_unref(pipeline->wakeup_source);
+    close(pipeline->wakeup_fd);
+    pthread_mutex_destroy(&pipeline->rings_lock);
     free(pipeline);
 }
 
+// Worker pipelines run their jobs on several threads. Every worker has its own
+// deque of jobs, it takes the newest one of its own and steals the oldest one
+// of another worker once it runs out.
+struct job {
+    MPPipelineCallback callback;
+    // Ordered jobs are completed in the order they were invoked in
+    MPPipelineCallback complete;
+    uint64_t sequence;
+    struct job *next;
+
+    _Alignas(16) uint8_t data[];
+};
+
+struct deque {
+    pthread_mutex_t lock;
+    struct job **jobs;
+    size_t capacity;
+    // Oldest and one past the newest job, as ever increasing counters
+    size_t top;
+    size_t bottom;
+};
+
+struct worker {
+    MPPipeline *pipeline;
+    int index;
+    pthread_t thread;
+    atomic_int tid;
+    struct deque deque;
+};
+
+struct workers {
+    int num_workers;
+    struct worker *workers;
+
+    // Queued jobs and where jobs from outside the pipeline go next
+    atomic_long num_jobs;
+    atomic_uint next_worker;
+
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t wake;
+    bool stop;
+
+    // Ordered jobs that ran but wait for earlier ones to complete, sorted
+    pthread_mutex_t order_lock;
+    atomic_uint_least64_t next_sequence;
+    uint64_t next_complete;
+    struct job *finished;
+    bool completing;
+};
+
+static _Thread_local struct worker *current_worker = NULL;
+
+static void deque_push(struct deque *deque, struct job *job)
+{
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom - deque->top == deque->capacity) {
+        size_t capacity = deque->capacity * 2;
+        struct job **jobs = malloc(sizeof(struct job *) * capacity);
+        for (size_t i = deque->top; i < deque->bottom; ++i) {
+            jobs[i % capacity] = deque->jobs[i % deque->capacity];
+        }
+        free(deque->jobs);
+        deque->jobs = jobs;
+        deque->capacity = capacity;
+    }
+
+    deque->jobs[deque->bottom++ % deque->capacity] = job;
+
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static struct job *deque_pop(struct deque *deque)
+{
+    struct job *job = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top) {
+        job = deque->jobs[--deque->bottom % deque->capacity];
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return job;
+}
+
+static struct job *deque_steal(struct deque *deque)
+{
+    struct job *job = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top) {
+        job = deque->jobs[deque->top++ % deque->capacity];
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return job;
+}
+
+static struct job *find_job(struct worker *worker)
+{
+    struct workers *workers = worker->pipeline->workers;
+
+    struct job *job = deque_pop(&worker->deque);
+    for (int i = 1; !job && i < workers->num_workers; ++i) {
+        job = deque_steal(&workers->workers[(worker->index + i) % workers->num_workers].deque);
+    }
+    return job;
+}
+
+static void complete_job(MPPipeline *pipeline, struct job *job)
+{
+    struct workers *workers = pipeline->workers;
+
+    pthread_mutex_lock(&workers->order_lock);
+
+    struct job **link = &workers->finished;
+    while (*link && (*link)->sequence < job->sequence) {
+        link = &(*link)->next;
+    }
+    job->next = *link;
+    *link = job;
+
+    // Another worker is already completing jobs and will get to this one
+    if (workers->completing) {
+        pthread_mutex_unlock(&workers->order_lock);
+        return;
+    }
+
+    workers->completing = true;
+    while (workers->finished && workers->finished->sequence == workers->next_complete) {
+        struct job *next = workers->finished;
+        workers->finished = next->next;
+        ++workers->next_complete;
+
+        pthread_mutex_unlock(&workers->order_lock);
+        next->complete(pipeline, next->data);
+        free(next);
+        pthread_mutex_lock(&workers->order_lock);
+    }
+    workers->completing = false;
+
+    pthread_mutex_unlock(&workers->order_lock);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *worker = arg;
+    struct workers *workers = worker->pipeline->workers;
+
+    current_worker = worker;
+    atomic_store(&worker->tid, syscall(SYS_gettid));
+
+    while (true) {
+        struct job *job = find_job(worker);
+        if (job) {
+            atomic_fetch_sub(&workers->num_jobs, 1);
+
+            job->callback(worker->pipeline, job->data);
+
+            if (job->complete) {
+                complete_job(worker->pipeline, job);
+            } else {
+                free(job);
+            }
+            continue;
+        }
+
+        // Jobs are counted before they're pushed, so one that was counted
+        // but not found yet is picked up on the next round
+        pthread_mutex_lock(&workers->sleep_lock);
+        while (atomic_load(&workers->num_jobs) == 0 && !workers->stop) {
+            pthread_cond_wait(&workers->wake, &workers->sleep_lock);
+        }
+        bool stop = workers->stop;
+        pthread_mutex_unlock(&workers->sleep_lock);
+
+        if (stop) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+MPPipeline *mp_pipeline_new_workers(int threads)
+{
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads <= 0) {
+        threads = 1;
+    }
+
+    MPPipeline *pipeline = malloc(sizeof(MPPipeline));
+    memset(pipeline, 0, sizeof(MPPipeline));
+
+    struct workers *workers = malloc(sizeof(struct workers));
+    workers->num_workers = threads;
+    workers->workers = calloc(threads, sizeof(struct worker));
+    atomic_init(&workers->num_jobs, 0);
+    atomic_init(&workers->next_worker, 0);
+    pthread_mutex_init(&workers->sleep_lock, NULL);
+    pthread_cond_init(&workers->wake, NULL);
+    workers->stop = false;
+    pthread_mutex_init(&workers->order_lock, NULL);
+    atomic_init(&workers->next_sequence, 0);
+    workers->next_complete = 0;
+    workers->finished = NULL;
+    workers->completing = false;
+    pipeline->workers = workers;
+
+    for (int i = 0; i < threads; ++i) {
+        struct worker *worker = &workers->workers[i];
+        worker->pipeline = pipeline;
+        worker->index = i;
+        atomic_init(&worker->tid, 0);
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        worker->deque.capacity = 16;
+        worker->deque.jobs = malloc(sizeof(struct job *) * worker->deque.capacity);
+        worker->deque.top = 0;
+        worker->deque.bottom = 0;
+    }
+
+    for (int i = 0; i < threads; ++i) {
+        int res = pthread_create(
+            &workers->workers[i].thread, NULL, worker_main, &workers->workers[i]);
+        assert(res == 0);
+    }
+
+    return pipeline;
+}
+
+static void workers_invoke(MPPipeline *pipeline, MPPipelineCallback callback, MPPipelineCallback complete, void *data, size_t size)
+{
+    struct workers *workers = pipeline->workers;
+
+    struct job *job = malloc(sizeof(struct job) + size);
+    job->callback = callback;
+    job->complete = complete;
+    job->next = NULL;
+    if (size > 0) {
+        memcpy(job->data, data, size);
+    }
+
+    // Sequence numbers are only taken by ordered jobs, so they can't be
+    // waited on by the others
+    if (complete) {
+        job->sequence = atomic_fetch_add(&workers->next_sequence, 1);
+    }
+
+    // Jobs invoked from a worker stay on it while they're hot in its cache
+    struct worker *worker = current_worker;
+    if (!worker || worker->pipeline != pipeline) {
+        worker = &workers->workers[atomic_fetch_add(&workers->next_worker, 1) % workers->num_workers];
+    }
+
+    atomic_fetch_add(&workers->num_jobs, 1);
+    deque_push(&worker->deque, job);
+
+    pthread_mutex_lock(&workers->sleep_lock);
+    pthread_cond_signal(&workers->wake);
+    pthread_mutex_unlock(&workers->sleep_lock);
+}
+
+struct ordered_args {
+    MPPipelineCallback callback;
+    MPPipelineCallback complete;
+};
+
+static void ordered_impl(MPPipeline *pipeline, struct ordered_args *args)
+{
+    args->callback(pipeline, args + 1);
+    args->complete(pipeline, args + 1);
+}
+
+void mp_pipeline_invoke_ordered(MPPipeline *pipeline, MPPipelineCallback callback, MPPipelineCallback complete, void *data, size_t size)
+{
+    if (pipeline->workers) {
+        workers_invoke(pipeline, callback, complete, data, size);
+        return;
+    }
+
+    // A single thread runs everything in order anyway
+    struct ordered_args *args = malloc(sizeof(struct ordered_args) + size);
+    args->callback = callback;
+    args->complete = complete;
+    if (size > 0) {
+        memcpy(args + 1, data, size);
+    }
+    mp_pipeline_invoke(pipeline, (MPPipelineCallback)ordered_impl, args, sizeof(struct ordered_args) + size);
+    free(args);
+}
+
+static void workers_free(struct workers *workers)
+{
+    pthread_mutex_lock(&workers->sleep_lock);
+    workers->stop = true;
+    pthread_cond_broadcast(&workers->wake);
+    pthread_mutex_unlock(&workers->sleep_lock);
+
+    // Like the single threaded pipelines, jobs that didn't start yet are
+    // dropped
+    for (int i = 0; i < workers->num_workers; ++i) {
+        pthread_join(workers->workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < workers->num_workers; ++i) {
+        struct deque *deque = &workers->workers[i].deque;
+        for (size_t j = deque->top; j < deque->bottom; ++j) {
+            free(deque->jobs[j % deque->capacity]);
+        }
+        free(deque->jobs);
+        pthread_mutex_destroy(&deque->lock);
+    }
+    while (workers->finished) {
+        struct job *next = workers->finished->next;
+        free(workers->finished);
+        workers->finished = next;
+    }
+
+    pthread_mutex_destroy(&workers->order_lock);
+    pthread_cond_destroy(&workers->wake);
+    pthread_mutex_destroy(&workers->sleep_lock);
+    free(workers->workers);
+    free(workers);
+}
+
+// A whole number from min to max
+static bool parse_int(const char *value, long min, long max, int *result)
+{
+    char *end;
+    errno = 0;
+    long number = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || number < min || number > max) {
+        return false;
+    }
+    *result = number;
+    return true;
+}
+
+bool mp_pipeline_schedule_parse(MPPipelineSchedule *schedule, const char *key, const char *value)
+{
+    if (strcmp(key, "cpus") == 0) {
+        // A list of cores and ranges of them, like 0,2-3
+        schedule->cpus = 0;
+        const char *s = value;
+        while (*s) {
+            char *end;
+            long first = strtol(s, &end, 10);
+            long last = first;
+            if (end == s) {
+                return false;
+            }
+            if (*end == '-') {
+                s = end + 1;
+                last = strtol(s, &end, 10);
+                if (end == s) {
+                    return false;
+                }
+            }
+            if (first < 0 || last < first || last >= 64) {
+                return false;
+            }
+            for (long cpu = first; cpu <= last; ++cpu) {
+                schedule->cpus |= 1ull << cpu;
+            }
+            s = end;
+            if (*s == ',') {
+                ++s;
+            } else if (*s) {
+                return false;
+            }
+        }
+    } else if (strcmp(key, "policy") == 0) {
+        if (strcmp(value, "other") == 0) {
+            schedule->policy = SCHED_OTHER;
+        } else if (strcmp(value, "fifo") == 0) {
+            schedule->policy = SCHED_FIFO;
+        } else if (strcmp(value, "rr") == 0) {
+            schedule->policy = SCHED_RR;
+        } else {
+            return false;
+        }
+    } else if (strcmp(key, "priority") == 0) {
+        // The same range for fifo and rr
+        return parse_int(value, sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO), &schedule->priority);
+    } else if (strcmp(key, "nice") == 0) {
+        return parse_int(value, -20, 19, &schedule->nice);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool set_thread_schedule(atomic_int *_tid, const MPPipelineSchedule *schedule)
+{
+    // The thread might not have started yet
+    pid_t tid;
+    while ((tid = atomic_load(_tid)) == 0) {
+        sched_yield();
+    }
+
+    bool ok = true;
+
+    if (schedule->cpus) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu = 0; cpu < 64; ++cpu) {
+            if (schedule->cpus & (1ull << cpu)) {
+                CPU_SET(cpu, &cpus);
+            }
+        }
+        if (sched_setaffinity(tid, sizeof(cpu_set_t), &cpus) == -1) {
+            g_printerr("MPPipeline: Could not set the affinity of thread %d, %s\n", tid, strerror(errno));
+            ok = false;
+        }
+    }
+
+    if (schedule->policy != SCHED_OTHER) {
+        // 0 is never valid for the real-time policies
+        struct sched_param param = {
+            .sched_priority = schedule->priority ? schedule->priority : sched_get_priority_min(schedule->policy),
+        };
+        if (sched_setscheduler(tid, schedule->policy, &param) == 0) {
+            return ok;
+        }
+
+        // Real-time scheduling needs CAP_SYS_NICE or an RLIMIT_RTPRIO, without
+        // them the nice value is the best we can do
+        g_printerr("MPPipeline: Could not use real-time scheduling for thread %d, %s, using nice %d\n", tid, strerror(errno), schedule->nice);
+        ok = false;
+    }
+
+    // The nice value is per thread on Linux
+    if (schedule->nice != 0 && setpriority(PRIO_PROCESS, tid, schedule->nice) == -1) {
+        g_printerr("MPPipeline: Could not set nice %d for thread %d, %s\n", schedule->nice, tid, strerror(errno));
+        ok = false;
+    }
+
+    return ok;
+}
+
+bool mp_pipeline_set_schedule(MPPipeline *pipeline, const MPPipelineSchedule *schedule)
+{
+    if (!pipeline->workers) {
+        return set_thread_schedule(&pipeline->tid, schedule);
+    }
+
+    bool ok = true;
+    for (int i = 0; i < pipeline->workers->num_workers; ++i) {
+        ok &= set_thread_schedule(&pipeline->workers->workers[i].tid, schedule);
+    }
+    return ok;
+}
+
 struct _MPPipelineCapture {
     MPPipeline *pipeline;
     MPCamera *camera;
+    // Memory to capture into if the driver takes it, or NULL
+    MPCameraBuffer *buffers;
+    uint32_t num_buffers;
 
-    void (*callback)(MPImage, void *);
+    void (*callback)(MPFrame *, void *);
     void *user_data;
     GSource *video_source;
+
+    // Frames that still hold a camera buffer, only used on the capture thread
+    uint32_t num_frames;
+
+    // Frames released on other threads, their buffers are queued again on the
+    // capture thread. The eventfd is signalled for every release, so ending
+    // the capture can wait for them without running any other messages.
+    pthread_mutex_t release_lock;
+    MPFrame *released;
+    int release_fd;
+    GSource *release_source;
+
+    // Time from the sensor timestamp until the buffer was dequeued, in µs,
+    // to tell how much the scheduling of the capture thread delays frames
+    uint32_t num_latencies;
+    double latency_sum;
+    double latency_sum_squares;
+    double latency_max;
+};
+
+struct _MPFrame {
+    atomic_int refcount;
+
+    MPPipelineCapture *capture;
+    MPImage image;
+    uint32_t index;
+
+    MPFrame *next_released;
 };
 
+MPFrame *mp_frame_ref(MPFrame *frame)
+{
+    atomic_fetch_add(&frame->refcount, 1);
+    return frame;
+}
+
+// Buffers can only be queued from the capture thread
+static void release_frame(MPFrame *frame)
+{
+    MPPipelineCapture *capture = frame->capture;
+
+    mp_camera_release_buffer(capture->camera, frame->index);
+    --capture->num_frames;
+
+    free(frame);
+}
+
+static void release_frames(MPPipelineCapture *capture)
+{
+    uint64_t count;
+    if (read(capture->release_fd, &count, sizeof(uint64_t)) == -1 && errno != EAGAIN) {
+        g_printerr("MPPipeline: eventfd read error %d, %s\n", errno, strerror(errno));
+    }
+
+    pthread_mutex_lock(&capture->release_lock);
+    MPFrame *frame = capture->released;
+    capture->released = NULL;
+    pthread_mutex_unlock(&capture->release_lock);
+
+    while (frame) {
+        MPFrame *next = frame->next_released;
+        release_frame(frame);
+        frame = next;
+    }
+}
+
+static bool on_release(int fd, GIOCondition condition, MPPipelineCapture *capture)
+{
+    release_frames(capture);
+    return true;
+}
+
+void mp_frame_unref(MPFrame *frame)
+{
+    if (atomic_fetch_sub(&frame->refcount, 1) != 1) {
+        return;
+    }
+
+    MPPipelineCapture *capture = frame->capture;
+    if (pthread_equal(pthread_self(), capture->pipeline->thread)) {
+        release_frame(frame);
+        return;
+    }
+
+    // Signalled under the lock, once the capture sees its last frame released
+    // it may be freed
+    pthread_mutex_lock(&capture->release_lock);
+    frame->next_released = capture->released;
+    capture->released = frame;
+    uint64_t count = 1;
+    if (write(capture->release_fd, &count, sizeof(uint64_t)) == -1) {
+        g_printerr("MPPipeline: eventfd write error %d, %s\n", errno, strerror(errno));
+    }
+    pthread_mutex_unlock(&capture->release_lock);
+}
+
+const MPImage *mp_frame_get_image(const MPFrame *frame)
+{
+    return &frame->image;
+}
+
 static bool on_capture(int fd, GIOCondition condition, MPPipelineCapture *capture)
 {
-    mp_camera_capture_image(capture->camera, capture->callback, capture->user_data);
+    MPImage image;
+    int index = mp_camera_capture_buffer(capture->camera, &image);
+    if (index < 0) {
+        return true;
+    }
+    mp_trace_end(MP_TRACE_DQBUF, image.sequence, image.timestamp);
+
+    if (image.timestamp) {
+        double latency = (mp_trace_now() - image.timestamp) / 1000.0;
+        ++capture->num_latencies;
+        capture->latency_sum += latency;
+        capture->latency_sum_squares += latency * latency;
+        if (latency > capture->latency_max) {
+            capture->latency_max = latency;
+        }
+    }
+
+    MPFrame *frame = malloc(sizeof(MPFrame));
+    atomic_init(&frame->refcount, 1);
+    frame->capture = capture;
+    frame->image = image;
+    frame->index = index;
+    ++capture->num_frames;
+
+    capture->callback(frame, capture->user_data);
+
+    mp_frame_unref(frame);
     return true;
 }
 
@@ -94,7 +986,11 @@ static void capture_start_impl(MPPipeline *pipeline, MPPipelineCapture **_captur
 {
     MPPipelineCapture *capture = *_capture;
 
-    mp_camera_start_capture(capture->camera);
+    if (capture->buffers) {
+        mp_camera_start_capture_into(capture->camera, capture->buffers, capture->num_buffers);
+    } else {
+        mp_camera_start_capture(capture->camera, capture->num_buffers);
+    }
 
     // Start watching for new captures
     int video_fd = mp_camera_get_video_fd(capture->camera);
@@ -105,16 +1001,43 @@ static void capture_start_impl(MPPipeline *pipeline, MPPipelineCapture **_captur
         capture,
         NULL);
     g_source_attach(capture->video_source, capture->pipeline->main_context);
+
+    capture->release_source = g_unix_fd_source_new(capture->release_fd, G_IO_IN);
+    g_source_set_callback(
+        capture->release_source,
+        (GSourceFunc)on_release,
+        capture,
+        NULL);
+    g_source_attach(capture->release_source, capture->pipeline->main_context);
 }
 
-MPPipelineCapture *mp_pipeline_capture_start(MPPipeline *pipeline, MPCamera *camera, void (*callback)(MPImage, void *), void *user_data)
+MPPipelineCapture *mp_pipeline_capture_start(MPPipeline *pipeline, MPCamera *camera, const MPCameraBuffer *buffers, uint32_t num_buffers, void (*callback)(MPFrame *, void *), void *user_data)
 {
+    // Captures need the main loop of a single threaded pipeline
+    g_return_val_if_fail(!pipeline->workers, NULL);
+
     MPPipelineCapture *capture = malloc(sizeof(MPPipelineCapture));
     capture->pipeline = pipeline;
     capture->camera = camera;
+    capture->buffers = NULL;
+    capture->num_buffers = num_buffers;
+    if (buffers) {
+        capture->buffers = malloc(sizeof(MPCameraBuffer) * num_buffers);
+        memcpy(capture->buffers, buffers, sizeof(MPCameraBuffer) * num_buffers);
+    }
     capture->callback = callback;
     capture->user_data = user_data;
     capture->video_source = NULL;
+    capture->num_frames = 0;
+    pthread_mutex_init(&capture->release_lock, NULL);
+    capture->released = NULL;
+    capture->release_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(capture->release_fd != -1);
+    capture->release_source = NULL;
+    capture->num_latencies = 0;
+    capture->latency_sum = 0;
+    capture->latency_sum_squares = 0;
+    capture->latency_max = 0;
 
     mp_pipeline_invoke(pipeline, (MPPipelineCallback)capture_start_impl, &capture, sizeof(MPPipelineCapture *));
 
@@ -125,9 +1048,40 @@ static void capture_end_impl(MPPipeline *pipeline, MPPipelineCapture **_capture)
 {
     MPPipelineCapture *capture = *_capture;
 
-    mp_camera_stop_capture(capture->camera);
     g_source_destroy(capture->video_source);
+    g_source_unref(capture->video_source);
 
+    // Stopping unmaps the buffers, so wait for the other threads to be done
+    // with them. Only their releases are handled meanwhile, other messages
+    // wait until the capture has ended.
+    release_frames(capture);
+    while (capture->num_frames > 0) {
+        struct pollfd pollfd = {
+            .fd = capture->release_fd,
+            .events = POLLIN,
+        };
+        if (poll(&pollfd, 1, -1) == -1 && errno != EINTR) {
+            g_printerr("MPPipeline: poll error %d, %s\n", errno, strerror(errno));
+            break;
+        }
+        release_frames(capture);
+    }
+
+    g_source_destroy(capture->release_source);
+    g_source_unref(capture->release_source);
+    close(capture->release_fd);
+    pthread_mutex_destroy(&capture->release_lock);
+
+    mp_camera_stop_capture(capture->camera);
+
+    if (capture->num_latencies > 0) {
+        double mean = capture->latency_sum / capture->num_latencies;
+        double variance = capture->latency_sum_squares / capture->num_latencies - mean * mean;
+        printf("Dequeue latency: %.0f µs mean, %.0f µs jitter, %.0f µs max over %u frames\n",
+               mean, sqrt(variance > 0 ? variance : 0), capture->latency_max, capture->num_latencies);
+    }
+
+    free(capture->buffers);
     free(capture);
 }
 
@@ -135,3 +1089,8 @@ void mp_pipeline_capture_end(MPPipelineCapture *capture)
 {
     mp_pipeline_invoke(capture->pipeline, (MPPipelineCallback)capture_end_impl, &capture, sizeof(MPPipelineCapture *));
 }
+
+uint32_t mp_pipeline_capture_get_num_queued_buffers(MPPipelineCapture *capture)
+{
+    return mp_camera_get_num_queued_buffers(capture->camera);
+}
@@ -8,10 +8,53 @@ typedef struct _MPPipeline MPPipeline;
 typedef void (*MPPipelineCallback)(MPPipeline *, void *);
 
 MPPipeline *mp_pipeline_new();
+// Runs invoked callbacks on a pool of threads, in parallel and in no
+// particular order. threads 0 starts one per online CPU.
+MPPipeline *mp_pipeline_new_workers(int threads);
 void mp_pipeline_invoke(MPPipeline *pipeline, MPPipelineCallback callback, void *data, size_t size);
+// Runs callback like mp_pipeline_invoke and then complete with the same data,
+// with the completions in the order the jobs were invoked in
+void mp_pipeline_invoke_ordered(MPPipeline *pipeline, MPPipelineCallback callback, MPPipelineCallback complete, void *data, size_t size);
+// Returns once the callbacks this thread invoked before have run. Not for
+// worker pipelines.
+void mp_pipeline_sync(MPPipeline *pipeline);
 void mp_pipeline_free(MPPipeline *pipeline);
 
+// Where and how the threads of a pipeline are scheduled
+typedef struct {
+    // Bit per core the threads may run on, 0 for any
+    uint64_t cpus;
+    // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+    int policy;
+    // For the real-time policies, 0 for their lowest priority
+    int priority;
+    // Also used when real-time scheduling isn't permitted
+    int nice;
+} MPPipelineSchedule;
+
+// Parses a "cpus", "policy" (other, fifo or rr), "priority" or "nice" setting
+bool mp_pipeline_schedule_parse(MPPipelineSchedule *schedule, const char *key, const char *value);
+// Fails when only part of the schedule could be applied, the rest is
+// still applied
+bool mp_pipeline_set_schedule(MPPipeline *pipeline, const MPPipelineSchedule *schedule);
+
+// A captured frame, read straight from the camera's buffer. The buffer is
+// given back to the driver once the last reference is dropped, from any thread.
+typedef struct _MPFrame MPFrame;
+
+MPFrame *mp_frame_ref(MPFrame *frame);
+void mp_frame_unref(MPFrame *frame);
+const MPImage *mp_frame_get_image(const MPFrame *frame);
+
 typedef struct _MPPipelineCapture MPPipelineCapture;
 
-MPPipelineCapture *mp_pipeline_capture_start(MPPipeline *pipeline, MPCamera *camera, void (*capture)(MPImage, void *), void *data);
+// The frame is only valid during the callback, unless it takes a reference.
+// Captures into buffers if given and the driver takes them, see
+// mp_camera_start_capture_into, or else into num_buffers of the driver's.
+MPPipelineCapture *mp_pipeline_capture_start(MPPipeline *pipeline, MPCamera *camera, const MPCameraBuffer *buffers, uint32_t num_buffers, void (*capture)(MPFrame *, void *), void *data);
+// Waits for every frame to be released before stopping the camera. Called from
+// another thread it only queues this on the pipeline, see mp_pipeline_sync.
 void mp_pipeline_capture_end(MPPipelineCapture *capture);
+// Buffers the camera can still fill, holding on to too many frames starves it.
+// Only valid on the capture thread.
+uint32_t mp_pipeline_capture_get_num_queued_buffers(MPPipelineCapture *capture);
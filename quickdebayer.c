@@ -1,49 +1,1855 @@
 #include "quickdebayer.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#define HAVE_NEON
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
 // Fast but bad debayer method that scales and rotates by skipping source pixels and
 // doesn't interpolate any values at all
 
+// Output pixels handled per kernel call, the channel planes for a chunk stay in L1
+#define CHUNK 128
+
+// Rows of chunks that are rotated together, together with CHUNK this keeps
+// both the tile and the destination lines it is written to in L1
+#define TILE_ROWS 16
+
+// Fractional bits of the colour matrix coefficients
+#define MATRIX_BITS 12
+
+// Binning sums up to 2 * skip^2 samples in 16 bits, which fits up to skip 11
+#define BIN_MAX_SKIP 11
+
+// Values the SIMD bin implementations may read past the last group
+#define BIN_PADDING 8
+
+// Bytes the unpacking may write past the last sample
+#define UNPACK_PADDING 16
+
+// Linear -> sRGB lookup table
+static const uint8_t srgb[256] = {
+	0, 12, 21, 28, 33, 38, 42, 46, 49, 52, 55, 58, 61, 63, 66, 68, 70, 73, 75, 77, 79,
+	81, 82, 84, 86, 88, 89, 91, 93, 94, 96, 97, 99, 100, 102, 103, 104, 106, 107, 109,
+	110, 111, 112, 114, 115, 116, 117, 118, 120, 121, 122, 123, 124, 125, 126, 127, 129,
+	130, 131, 132, 133, 134, 135, 136, 137, 138, 139, 140, 141, 142, 142, 143, 144, 145,
+	146, 147, 148, 149, 150, 151, 151, 152, 153, 154, 155, 156, 157, 157, 158, 159, 160,
+	161, 161, 162, 163, 164, 165, 165, 166, 167, 168, 168, 169, 170, 171, 171, 172, 173,
+	174, 174, 175, 176, 176, 177, 178, 179, 179, 180, 181, 181, 182, 183, 183, 184, 185,
+	185, 186, 187, 187, 188, 189, 189, 190, 191, 191, 192, 193, 193, 194, 194, 195, 196,
+	196, 197, 197, 198, 199, 199, 200, 201, 201, 202, 202, 203, 204, 204, 205, 205, 206,
+	206, 207, 208, 208, 209, 209, 210, 210, 211, 212, 212, 213, 213, 214, 214, 215, 215,
+	216, 217, 217, 218, 218, 219, 219, 220, 220, 221, 221, 222, 222, 223, 223, 224, 224,
+	225, 226, 226, 227, 227, 228, 228, 229, 229, 230, 230, 231, 231, 232, 232, 233, 233,
+	234, 234, 235, 235, 236, 236, 237, 237, 237, 238, 238, 239, 239, 240, 240, 241, 241,
+	242, 242, 243, 243, 244, 244, 245, 245, 245, 246, 246, 247, 247, 248, 248, 249, 249,
+	250, 250, 251, 251, 251, 252, 252, 253, 253, 254, 254, 255
+};
+
+static void
+sanitize_levels(int *blacklevel, int *whitelevel)
+{
+	if (*blacklevel < 0 || *blacklevel > 254) {
+		*blacklevel = 0;
+	}
+	if (*whitelevel <= *blacklevel || *whitelevel > 255) {
+		*whitelevel = 255;
+	}
+}
+
+void
+quick_debayer_lut_init(QuickDebayerLut *lut, int blacklevel, int whitelevel, const float gains[3])
+{
+	sanitize_levels(&blacklevel, &whitelevel);
+
+	uint8_t *tables[3] = { lut->r, lut->g, lut->b };
+	for (int c = 0; c < 3; ++c) {
+		float scale = (gains ? gains[c] : 1.0f) * 255.0f / (whitelevel - blacklevel);
+		for (int i = 0; i < 256; ++i) {
+			// Everything under the black level is black, and everything
+			// that ends up over the white level after the gain is white
+			float value = (i - blacklevel) * scale + 0.5f;
+			tables[c][i] = srgb[value < 0.0f ? 0 : (value > 255.0f ? 255 : (int)value)];
+		}
+	}
+
+	lut->use_matrix = false;
+}
+
 void
-quick_debayer_bggr8(const uint8_t *source, uint8_t *destination, int width, int height, int skip, int blacklevel)
-{
-	int byteskip = 2 * skip;
-	int input_size = width * height;
-	int i;
-	int j=0;
-	int row_left = width;
-
-	// Linear -> sRGB lookup table
-	static int srgb[] = {
-		0, 12, 21, 28, 33, 38, 42, 46, 49, 52, 55, 58, 61, 63, 66, 68, 70, 73, 75, 77, 79, 
-		81, 82, 84, 86, 88, 89, 91, 93, 94, 96, 97, 99, 100, 102, 103, 104, 106, 107, 109,
-		110, 111, 112, 114, 115, 116, 117, 118, 120, 121, 122, 123, 124, 125, 126, 127, 129,
-		130, 131, 132, 133, 134, 135, 136, 137, 138, 139, 140, 141, 142, 142, 143, 144, 145,
-		146, 147, 148, 149, 150, 151, 151, 152, 153, 154, 155, 156, 157, 157, 158, 159, 160,
-		161, 161, 162, 163, 164, 165, 165, 166, 167, 168, 168, 169, 170, 171, 171, 172, 173,
-		174, 174, 175, 176, 176, 177, 178, 179, 179, 180, 181, 181, 182, 183, 183, 184, 185,
-		185, 186, 187, 187, 188, 189, 189, 190, 191, 191, 192, 193, 193, 194, 194, 195, 196,
-		196, 197, 197, 198, 199, 199, 200, 201, 201, 202, 202, 203, 204, 204, 205, 205, 206,
-		206, 207, 208, 208, 209, 209, 210, 210, 211, 212, 212, 213, 213, 214, 214, 215, 215,
-		216, 217, 217, 218, 218, 219, 219, 220, 220, 221, 221, 222, 222, 223, 223, 224, 224,
-		225, 226, 226, 227, 227, 228, 228, 229, 229, 230, 230, 231, 231, 232, 232, 233, 233,
-		234, 234, 235, 235, 236, 236, 237, 237, 237, 238, 238, 239, 239, 240, 240, 241, 241,
-		242, 242, 243, 243, 244, 244, 245, 245, 245, 246, 246, 247, 247, 248, 248, 249, 249,
-		250, 250, 251, 251, 251, 252, 252, 253, 253, 254, 254, 255
-	};
+quick_debayer_lut_init_matrix(QuickDebayerLut *lut, int blacklevel, int whitelevel, const float gains[3], const float matrix[9])
+{
+	sanitize_levels(&blacklevel, &whitelevel);
 
-	// B G
-	// G R
-	for(i=0;i<input_size;) {
-		destination[j++] = srgb[source[i+width+1] - blacklevel];
-		destination[j++] = srgb[source[i+1] - blacklevel];
-		destination[j++] = srgb[source[i] - blacklevel];
-		i = i + byteskip;
-		row_left = row_left - byteskip;
-		if(row_left < byteskip){
-			i = i + row_left;
-			row_left = width;
-			i = i + width;
-			i = i + (width * 2 * (skip-1));
+	// The white level and gains scale the matrix columns, only the black
+	// level has to be subtracted before it
+	for (int c = 0; c < 3; ++c) {
+		for (int j = 0; j < 3; ++j) {
+			float scale = (gains ? gains[j] : 1.0f) * 255.0f / (whitelevel - blacklevel);
+			float value = matrix[c * 3 + j] * scale * (1 << MATRIX_BITS);
+			value = value < INT16_MIN ? INT16_MIN : (value > INT16_MAX ? INT16_MAX : value);
+			lut->matrix[c * 3 + j] = (int16_t)(value < 0.0f ? value - 0.5f : value + 0.5f);
+		}
+	}
+	lut->blacklevel = blacklevel;
+
+	memcpy(lut->r, srgb, sizeof(srgb));
+	memcpy(lut->g, srgb, sizeof(srgb));
+	memcpy(lut->b, srgb, sizeof(srgb));
+
+	lut->use_matrix = true;
+}
+
+// Used when the caller doesn't pass tables, plain sRGB
+static QuickDebayerLut default_lut;
+
+struct debayer_ops {
+	bool (*supported)();
+
+	// Copy every step'th byte starting at src into dst. Implementations may
+	// read whole vectors as long as they don't go past end.
+	void (*gather)(const uint8_t *src, const uint8_t *end, int step, int count, uint8_t *dst);
+
+	// Map the channel planes through their lookup tables and interleave them
+	// into packed RGB
+	void (*tone_pack)(const uint8_t *r, const uint8_t *g, const uint8_t *b, int count, const QuickDebayerLut *lut, uint8_t *dst);
+	// Same but into native endian 0xffRRGGBB words
+	void (*tone_pack_xrgb)(const uint8_t *r, const uint8_t *g, const uint8_t *b, int count, const QuickDebayerLut *lut, uint8_t *dst);
+
+	// Binning: add up rows bytes that are stride apart, for count columns
+	void (*row_sum)(const uint8_t *src, int stride, int rows, int count, uint16_t *dst);
+
+	// Binning: add up the even and the odd columns of every group of 2 * skip
+	// summed columns. May read up to BIN_PADDING values past the last group.
+	void (*bin)(const uint16_t *sums, int skip, int count, uint16_t *even, uint16_t *odd);
+
+	// Binning: ((a + b + bias) * recip) >> 16, the rounded mean when recip
+	// is 65536 divided by the number of samples in a + b
+	void (*average)(const uint16_t *a, const uint16_t *b, int count, uint16_t bias, uint16_t recip, uint8_t *dst);
+
+	// Subtract the black level from the channel planes and apply the colour
+	// matrix of the tables, in place
+	void (*matrix)(uint8_t *r, uint8_t *g, uint8_t *b, int count, const QuickDebayerLut *lut);
+
+	// Unpacking: the top 8 bits of count 16-bit little endian samples,
+	// which are shift bits deeper than 8
+	void (*unpack16)(const uint8_t *src, int count, int shift, uint8_t *dst);
+
+	// Unpacking: copy the first samples bytes of count groups of group
+	// bytes, which hold the top 8 bits of MIPI packed samples.
+	// Implementations may read whole vectors as long as they don't go past
+	// end, and write up to UNPACK_PADDING bytes past the last sample.
+	void (*unpack_packed)(const uint8_t *src, const uint8_t *end, int group, int samples, int count, uint8_t *dst);
+};
+
+// Number of whole step'th pixels that can be read starting at src
+static inline int
+gather_limit(const uint8_t *src, const uint8_t *end, int step, int count)
+{
+	ptrdiff_t available = (end - src) / step;
+	return available < count ? (int)available : count;
+}
+
+static bool
+supported_c()
+{
+	return true;
+}
+
+static void
+gather_c(const uint8_t *src, const uint8_t *end, int step, int count, uint8_t *dst)
+{
+	for (int i = 0; i < count; ++i) {
+		dst[i] = src[i * step];
+	}
+}
+
+static void
+tone_pack_c(const uint8_t *r, const uint8_t *g, const uint8_t *b, int count, const QuickDebayerLut *lut, uint8_t *dst)
+{
+	for (int i = 0; i < count; ++i) {
+		dst[i * 3 + 0] = lut->r[r[i]];
+		dst[i * 3 + 1] = lut->g[g[i]];
+		dst[i * 3 + 2] = lut->b[b[i]];
+	}
+}
+
+static void
+tone_pack_xrgb_c(const uint8_t *r, const uint8_t *g, const uint8_t *b, int count, const QuickDebayerLut *lut, uint8_t *dst)
+{
+	for (int i = 0; i < count; ++i) {
+		uint32_t pixel = 0xff000000 | lut->r[r[i]] << 16 | lut->g[g[i]] << 8 | lut->b[b[i]];
+		memcpy(dst + i * 4, &pixel, 4);
+	}
+}
+
+static void
+row_sum_c(const uint8_t *src, int stride, int rows, int count, uint16_t *dst)
+{
+	for (int i = 0; i < count; ++i) {
+		dst[i] = src[i];
+	}
+	for (int r = 1; r < rows; ++r) {
+		src += stride;
+		for (int i = 0; i < count; ++i) {
+			dst[i] += src[i];
+		}
+	}
+}
+
+static void
+bin_c(const uint16_t *sums, int skip, int count, uint16_t *even, uint16_t *odd)
+{
+	for (int i = 0; i < count; ++i) {
+		const uint16_t *s = sums + i * skip * 2;
+		uint16_t e = 0, o = 0;
+		for (int j = 0; j < skip; ++j) {
+			e += s[j * 2];
+			o += s[j * 2 + 1];
+		}
+		even[i] = e;
+		odd[i] = o;
+	}
+}
+
+static void
+average_c(const uint16_t *a, const uint16_t *b, int count, uint16_t bias, uint16_t recip, uint8_t *dst)
+{
+	for (int i = 0; i < count; ++i) {
+		uint16_t sum = a[i] + b[i] + bias;
+		dst[i] = (sum * (uint32_t)recip) >> 16;
+	}
+}
+
+static void
+matrix_c(uint8_t *r, uint8_t *g, uint8_t *b, int count, const QuickDebayerLut *lut)
+{
+	const int16_t *m = lut->matrix;
+	int black = lut->blacklevel;
+	uint8_t *planes[3] = { r, g, b };
+
+	for (int i = 0; i < count; ++i) {
+		int in[3];
+		for (int c = 0; c < 3; ++c) {
+			in[c] = planes[c][i] > black ? planes[c][i] - black : 0;
+		}
+		for (int c = 0; c < 3; ++c) {
+			int value = m[c * 3 + 0] * in[0] + m[c * 3 + 1] * in[1] + m[c * 3 + 2] * in[2];
+			value = (value + (1 << (MATRIX_BITS - 1))) >> MATRIX_BITS;
+			planes[c][i] = value < 0 ? 0 : (value > 255 ? 255 : value);
+		}
+	}
+}
+
+static void
+unpack16_c(const uint8_t *src, int count, int shift, uint8_t *dst)
+{
+	for (int i = 0; i < count; ++i) {
+		dst[i] = (src[i * 2] | src[i * 2 + 1] << 8) >> shift;
+	}
+}
+
+static void
+unpack_packed_c(const uint8_t *src, const uint8_t *end, int group, int samples, int count, uint8_t *dst)
+{
+	for (int i = 0; i < count; ++i) {
+		memcpy(dst + i * samples, src + i * group, samples);
+	}
+}
+
+// Shuffles for the vector unpacking, picking the samples bytes of every
+// whole group in 16 bytes. For 12-bit (groups of 3) and 10-bit (groups of 5).
+static uint8_t unpack_masks[2][16];
+
+static void
+init_unpack_masks()
+{
+	for (int m = 0; m < 2; ++m) {
+		int group = m ? 5 : 3;
+		int samples = group - 1;
+		for (int j = 0; j < 16; ++j) {
+			int pos = (j / samples) * group + j % samples;
+			unpack_masks[m][j] = j < 16 / group * samples ? pos : 0x80;
+		}
+	}
+}
+
+static const struct debayer_ops ops_c = {
+	.supported = supported_c,
+	.gather = gather_c,
+	.tone_pack = tone_pack_c,
+	.tone_pack_xrgb = tone_pack_xrgb_c,
+	.row_sum = row_sum_c,
+	.bin = bin_c,
+	.average = average_c,
+	.matrix = matrix_c,
+	.unpack16 = unpack16_c,
+	.unpack_packed = unpack_packed_c,
+};
+
+#ifdef HAVE_X86
+
+static bool
+supported_sse2()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2"))) static void
+gather_sse2(const uint8_t *src, const uint8_t *end, int step, int count, uint8_t *dst)
+{
+	int limit = gather_limit(src, end, step, count);
+	int i = 0;
+
+	if (step == 2) {
+		const __m128i mask = _mm_set1_epi16(0xff);
+		for (; i + 16 <= limit; i += 16) {
+			const __m128i *p = (const __m128i *)(src + i * 2);
+			__m128i a = _mm_and_si128(_mm_loadu_si128(p + 0), mask);
+			__m128i b = _mm_and_si128(_mm_loadu_si128(p + 1), mask);
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+		}
+	} else if (step == 4) {
+		const __m128i mask = _mm_set1_epi32(0xff);
+		for (; i + 16 <= limit; i += 16) {
+			const __m128i *p = (const __m128i *)(src + i * 4);
+			__m128i a = _mm_and_si128(_mm_loadu_si128(p + 0), mask);
+			__m128i b = _mm_and_si128(_mm_loadu_si128(p + 1), mask);
+			__m128i c = _mm_and_si128(_mm_loadu_si128(p + 2), mask);
+			__m128i d = _mm_and_si128(_mm_loadu_si128(p + 3), mask);
+			__m128i ab = _mm_packs_epi32(a, b);
+			__m128i cd = _mm_packs_epi32(c, d);
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(ab, cd));
+		}
+	}
+
+	for (; i < count; ++i) {
+		dst[i] = src[i * step];
+	}
+}
+
+__attribute__((target("sse2"))) static void
+row_sum_sse2(const uint8_t *src, int stride, int rows, int count, uint16_t *dst)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+		for (int r = 1; r < rows; ++r) {
+			v = _mm_loadu_si128((const __m128i *)(src + r * stride + i));
+			lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+			hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+		}
+		_mm_storeu_si128((__m128i *)(dst + i), lo);
+		_mm_storeu_si128((__m128i *)(dst + i + 8), hi);
+	}
+
+	row_sum_c(src + i, stride, rows, count - i, dst + i);
+}
+
+// Sum of the groups of skip 32-bit (even, odd) pairs starting at p, for four
+// groups. The 16-bit halves never carry into each other.
+__attribute__((target("sse2"))) static inline __m128i
+bin4_sse2(const uint16_t *p, int skip)
+{
+	const __m128i *v = (const __m128i *)p;
+	if (skip == 1) {
+		return _mm_loadu_si128(v);
+	} else if (skip == 2) {
+		__m128i a = _mm_loadu_si128(v + 0);
+		__m128i b = _mm_loadu_si128(v + 1);
+		a = _mm_add_epi16(a, _mm_srli_epi64(a, 32));
+		b = _mm_add_epi16(b, _mm_srli_epi64(b, 32));
+		return _mm_unpacklo_epi64(_mm_shuffle_epi32(a, 0x08), _mm_shuffle_epi32(b, 0x08));
+	} else {
+		// Add the next two pairs onto every pair, then keep every third one
+		__m128i t[3];
+		for (int j = 0; j < 3; ++j) {
+			const uint16_t *q = p + j * 8;
+			t[j] = _mm_add_epi16(_mm_loadu_si128((const __m128i *)q),
+				_mm_add_epi16(_mm_loadu_si128((const __m128i *)(q + 2)),
+					_mm_loadu_si128((const __m128i *)(q + 4))));
+		}
+		__m128 t69 = _mm_shuffle_ps(_mm_castsi128_ps(t[1]), _mm_castsi128_ps(t[2]), _MM_SHUFFLE(1, 1, 2, 2));
+		return _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(t[0]), t69, _MM_SHUFFLE(2, 0, 3, 0)));
+	}
+}
+
+__attribute__((target("sse2"))) static void
+bin_sse2(const uint16_t *sums, int skip, int count, uint16_t *even, uint16_t *odd)
+{
+	int i = 0;
+	if (skip <= 3) {
+		const __m128i mask = _mm_set1_epi32(0xffff);
+		for (; i + 8 <= count; i += 8) {
+			__m128i a = bin4_sse2(sums + i * skip * 2, skip);
+			__m128i b = bin4_sse2(sums + (i + 4) * skip * 2, skip);
+
+			// The sums stay below 32768, so the signed pack is fine
+			__m128i e = _mm_packs_epi32(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+			__m128i o = _mm_packs_epi32(_mm_srli_epi32(a, 16), _mm_srli_epi32(b, 16));
+			_mm_storeu_si128((__m128i *)(even + i), e);
+			_mm_storeu_si128((__m128i *)(odd + i), o);
+		}
+	}
+
+	bin_c(sums + i * skip * 2, skip, count - i, even + i, odd + i);
+}
+
+__attribute__((target("sse2"))) static void
+average_sse2(const uint16_t *a, const uint16_t *b, int count, uint16_t bias, uint16_t recip, uint8_t *dst)
+{
+	const __m128i vbias = _mm_set1_epi16(bias);
+	const __m128i vrecip = _mm_set1_epi16(recip);
+	int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i lo = _mm_add_epi16(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+		__m128i hi = _mm_add_epi16(_mm_loadu_si128((const __m128i *)(a + i + 8)), _mm_loadu_si128((const __m128i *)(b + i + 8)));
+		lo = _mm_mulhi_epu16(_mm_add_epi16(lo, vbias), vrecip);
+		hi = _mm_mulhi_epu16(_mm_add_epi16(hi, vbias), vrecip);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+
+	average_c(a + i, b + i, count - i, bias, recip, dst + i);
+}
+
+// One output channel for 8 pixels. rg holds interleaved red and green, b1
+// interleaved blue and 1 so the rounding comes out of the same madd.
+__attribute__((target("sse2"))) static inline __m128i
+matrix_row_sse2(__m128i rg_lo, __m128i rg_hi, __m128i b1_lo, __m128i b1_hi, const int16_t *m)
+{
+	const __m128i mrg = _mm_set1_epi32((int)((uint32_t)(uint16_t)m[1] << 16 | (uint16_t)m[0]));
+	const __m128i mb = _mm_set1_epi32((int)((uint32_t)(1 << (MATRIX_BITS - 1)) << 16 | (uint16_t)m[2]));
+	__m128i lo = _mm_add_epi32(_mm_madd_epi16(rg_lo, mrg), _mm_madd_epi16(b1_lo, mb));
+	__m128i hi = _mm_add_epi32(_mm_madd_epi16(rg_hi, mrg), _mm_madd_epi16(b1_hi, mb));
+	return _mm_packs_epi32(_mm_srai_epi32(lo, MATRIX_BITS), _mm_srai_epi32(hi, MATRIX_BITS));
+}
+
+__attribute__((target("sse2"))) static void
+matrix_sse2(uint8_t *r, uint8_t *g, uint8_t *b, int count, const QuickDebayerLut *lut)
+{
+	const __m128i black = _mm_set1_epi8((char)lut->blacklevel);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi16(1);
+	uint8_t *planes[3] = { r, g, b };
+
+	int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i vr = _mm_subs_epu8(_mm_loadu_si128((const __m128i *)(r + i)), black);
+		__m128i vg = _mm_subs_epu8(_mm_loadu_si128((const __m128i *)(g + i)), black);
+		__m128i vb = _mm_subs_epu8(_mm_loadu_si128((const __m128i *)(b + i)), black);
+
+		// Red and green are interleaved as bytes first, widening then gives
+		// the 16-bit pairs madd wants
+		__m128i rg_lo = _mm_unpacklo_epi8(vr, vg);
+		__m128i rg_hi = _mm_unpackhi_epi8(vr, vg);
+		__m128i b_lo = _mm_unpacklo_epi8(vb, zero);
+		__m128i b_hi = _mm_unpackhi_epi8(vb, zero);
+
+		__m128i rg[4] = {
+			_mm_unpacklo_epi8(rg_lo, zero), _mm_unpackhi_epi8(rg_lo, zero),
+			_mm_unpacklo_epi8(rg_hi, zero), _mm_unpackhi_epi8(rg_hi, zero),
+		};
+		__m128i b1[4] = {
+			_mm_unpacklo_epi16(b_lo, one), _mm_unpackhi_epi16(b_lo, one),
+			_mm_unpacklo_epi16(b_hi, one), _mm_unpackhi_epi16(b_hi, one),
+		};
+
+		__m128i out[3];
+		for (int c = 0; c < 3; ++c) {
+			const int16_t *m = lut->matrix + c * 3;
+			__m128i lo = matrix_row_sse2(rg[0], rg[1], b1[0], b1[1], m);
+			__m128i hi = matrix_row_sse2(rg[2], rg[3], b1[2], b1[3], m);
+			out[c] = _mm_packus_epi16(lo, hi);
+		}
+		for (int c = 0; c < 3; ++c) {
+			_mm_storeu_si128((__m128i *)(planes[c] + i), out[c]);
+		}
+	}
+
+	matrix_c(r + i, g + i, b + i, count - i, lut);
+}
+
+__attribute__((target("sse2"))) static void
+unpack16_sse2(const uint8_t *src, int count, int shift, uint8_t *dst)
+{
+	// Masked instead of saturated, out of range samples wrap like in C
+	__m128i bits = _mm_cvtsi32_si128(shift);
+	__m128i mask = _mm_set1_epi16(0xff);
+	int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		const __m128i *p = (const __m128i *)(src + i * 2);
+		__m128i lo = _mm_and_si128(_mm_srl_epi16(_mm_loadu_si128(p), bits), mask);
+		__m128i hi = _mm_and_si128(_mm_srl_epi16(_mm_loadu_si128(p + 1), bits), mask);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+
+	unpack16_c(src + i * 2, count - i, shift, dst + i);
+}
+
+// SSE2 has no byte shuffle or gather, so the table lookup, interleaving and
+// unpacking of MIPI packed rows are left to the scalar code
+static const struct debayer_ops ops_sse2 = {
+	.supported = supported_sse2,
+	.gather = gather_sse2,
+	.tone_pack = tone_pack_c,
+	.tone_pack_xrgb = tone_pack_xrgb_c,
+	.row_sum = row_sum_sse2,
+	.bin = bin_sse2,
+	.average = average_sse2,
+	.matrix = matrix_sse2,
+	.unpack16 = unpack16_sse2,
+	.unpack_packed = unpack_packed_c,
+};
+
+static bool
+supported_avx2()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+// pshufb masks selecting every 6th byte out of 6 consecutive vectors
+static uint8_t gather_masks[6][16];
+
+static void
+init_avx2_masks()
+{
+	for (int v = 0; v < 6; ++v) {
+		for (int j = 0; j < 16; ++j) {
+			int pos = j * 6 - v * 16;
+			gather_masks[v][j] = (pos >= 0 && pos < 16) ? pos : 0x80;
+		}
+	}
+}
+
+__attribute__((target("avx2"))) static inline int
+gather_pshufb6(const uint8_t *src, int limit, uint8_t *dst)
+{
+	const __m128i *masks = (const __m128i *)gather_masks;
+	int i = 0;
+	for (; i + 16 <= limit; i += 16) {
+		const __m128i *p = (const __m128i *)(src + i * 6);
+		__m128i out = _mm_shuffle_epi8(_mm_loadu_si128(p), _mm_loadu_si128(masks));
+		for (int v = 1; v < 6; ++v) {
+			out = _mm_or_si128(out, _mm_shuffle_epi8(
+				_mm_loadu_si128(p + v), _mm_loadu_si128(masks + v)));
+		}
+		_mm_storeu_si128((__m128i *)(dst + i), out);
+	}
+	return i;
+}
+
+__attribute__((target("avx2"))) static void
+gather_avx2(const uint8_t *src, const uint8_t *end, int step, int count, uint8_t *dst)
+{
+	int limit = gather_limit(src, end, step, count);
+	int i = 0;
+
+	if (step == 2) {
+		const __m256i mask = _mm256_set1_epi16(0xff);
+		for (; i + 32 <= limit; i += 32) {
+			const __m256i *p = (const __m256i *)(src + i * 2);
+			__m256i a = _mm256_and_si256(_mm256_loadu_si256(p + 0), mask);
+			__m256i b = _mm256_and_si256(_mm256_loadu_si256(p + 1), mask);
+
+			// packus works per 128-bit lane, restore the order afterwards
+			__m256i out = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+			_mm256_storeu_si256((__m256i *)(dst + i), out);
+		}
+	} else if (step == 4) {
+		const __m256i mask = _mm256_set1_epi32(0xff);
+		const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+		for (; i + 32 <= limit; i += 32) {
+			const __m256i *p = (const __m256i *)(src + i * 4);
+			__m256i a = _mm256_and_si256(_mm256_loadu_si256(p + 0), mask);
+			__m256i b = _mm256_and_si256(_mm256_loadu_si256(p + 1), mask);
+			__m256i c = _mm256_and_si256(_mm256_loadu_si256(p + 2), mask);
+			__m256i d = _mm256_and_si256(_mm256_loadu_si256(p + 3), mask);
+			__m256i ab = _mm256_packus_epi32(a, b);
+			__m256i cd = _mm256_packus_epi32(c, d);
+			__m256i out = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(ab, cd), order);
+			_mm256_storeu_si256((__m256i *)(dst + i), out);
+		}
+	} else if (step == 6) {
+		i = gather_pshufb6(src, limit, dst);
+	}
+
+	for (; i < count; ++i) {
+		dst[i] = src[i * step];
+	}
+}
+
+__attribute__((target("avx2"))) static void
+unpack_packed_avx2(const uint8_t *src, const uint8_t *end, int group, int samples, int count, uint8_t *dst)
+{
+	__m128i mask = _mm_loadu_si128((const __m128i *)unpack_masks[group == 5]);
+	int groups = 16 / group;
+	int i = 0;
+	for (; i + groups <= count && src + i * group + 16 <= end; i += groups) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i * group));
+		_mm_storeu_si128((__m128i *)(dst + i * samples), _mm_shuffle_epi8(v, mask));
+	}
+
+	unpack_packed_c(src + i * group, end, group, samples, count - i, dst + i * samples);
+}
+
+// vpgatherdd lookups measured slower than scalar loads from the L1 resident
+// table, so only the deinterleaving is vectorized. 256-bit row sums measured
+// slower than the SSE2 ones as well.
+static const struct debayer_ops ops_avx2 = {
+	.supported = supported_avx2,
+	.gather = gather_avx2,
+	.tone_pack = tone_pack_c,
+	.tone_pack_xrgb = tone_pack_xrgb_c,
+	.row_sum = row_sum_sse2,
+	.bin = bin_sse2,
+	.average = average_sse2,
+	.matrix = matrix_sse2,
+	.unpack16 = unpack16_sse2,
+	.unpack_packed = unpack_packed_avx2,
+};
+
+#endif
+
+#ifdef HAVE_NEON
+
+static bool
+supported_neon()
+{
+#ifdef __aarch64__
+	return true;
+#else
+	return getauxval(AT_HWCAP) & HWCAP_NEON;
+#endif
+}
+
+static void
+gather_neon(const uint8_t *src, const uint8_t *end, int step, int count, uint8_t *dst)
+{
+	int limit = gather_limit(src, end, step, count);
+	int i = 0;
+
+	if (step == 2) {
+		for (; i + 16 <= limit; i += 16) {
+			vst1q_u8(dst + i, vld2q_u8(src + i * 2).val[0]);
+		}
+	} else if (step == 4) {
+		for (; i + 16 <= limit; i += 16) {
+			vst1q_u8(dst + i, vld4q_u8(src + i * 4).val[0]);
+		}
+	} else if (step == 6) {
+		for (; i + 16 <= limit; i += 16) {
+			const uint8_t *p = src + i * 6;
+			uint8x16_t a = vld3q_u8(p).val[0];
+			uint8x16_t b = vld3q_u8(p + 48).val[0];
+			vst1q_u8(dst + i, vuzpq_u8(a, b).val[0]);
 		}
 	}
+
+	for (; i < count; ++i) {
+		dst[i] = src[i * step];
+	}
+}
+
+#ifdef __aarch64__
+// The 256 entry table is split over four 64 byte tbl lookups
+typedef uint8x16x4_t neon_lut[4];
+
+static inline void
+load_lut_neon(const uint8_t *lut, neon_lut table)
+{
+	for (int t = 0; t < 4; ++t) {
+		for (int k = 0; k < 4; ++k) {
+			table[t].val[k] = vld1q_u8(lut + t * 64 + k * 16);
+		}
+	}
+}
+
+static inline uint8x16_t
+lut_neon(const neon_lut table, uint8x16_t index)
+{
+	const uint8x16_t offset = vdupq_n_u8(64);
+	uint8x16_t out = vqtbl4q_u8(table[0], index);
+	for (int t = 1; t < 4; ++t) {
+		index = vsubq_u8(index, offset);
+		out = vqtbx4q_u8(out, table[t], index);
+	}
+	return out;
+}
+#else
+// The 256 entry table is split over eight 32 byte vtbl lookups
+typedef uint8x8x4_t neon_lut[8];
+
+static inline void
+load_lut_neon(const uint8_t *lut, neon_lut table)
+{
+	for (int t = 0; t < 8; ++t) {
+		for (int k = 0; k < 4; ++k) {
+			table[t].val[k] = vld1_u8(lut + t * 32 + k * 8);
+		}
+	}
+}
+
+static inline uint8x16_t
+lut_neon(const neon_lut table, uint8x16_t index)
+{
+	const uint8x8_t offset = vdup_n_u8(32);
+	uint8x8_t lo = vget_low_u8(index);
+	uint8x8_t hi = vget_high_u8(index);
+	uint8x8_t out_lo = vtbl4_u8(table[0], lo);
+	uint8x8_t out_hi = vtbl4_u8(table[0], hi);
+	for (int t = 1; t < 8; ++t) {
+		lo = vsub_u8(lo, offset);
+		hi = vsub_u8(hi, offset);
+		out_lo = vtbx4_u8(out_lo, table[t], lo);
+		out_hi = vtbx4_u8(out_hi, table[t], hi);
+	}
+	return vcombine_u8(out_lo, out_hi);
+}
+#endif
+
+static void
+lookup_neon(const uint8_t *src, int count, const uint8_t *lut, uint8_t *dst)
+{
+	neon_lut table;
+	load_lut_neon(lut, table);
+
+	for (int i = 0; i < count; i += 16) {
+		vst1q_u8(dst + i, lut_neon(table, vld1q_u8(src + i)));
+	}
+}
+
+static void
+tone_pack_neon(const uint8_t *r, const uint8_t *g, const uint8_t *b, int count, const QuickDebayerLut *lut, uint8_t *dst)
+{
+	// A table fills half the register file, so the channels are looked up
+	// one after the other and interleaved afterwards
+	int vectors = count & ~15;
+	uint8_t rgb_planes[3][CHUNK];
+	lookup_neon(r, vectors, lut->r, rgb_planes[0]);
+	lookup_neon(g, vectors, lut->g, rgb_planes[1]);
+	lookup_neon(b, vectors, lut->b, rgb_planes[2]);
+
+	for (int i = 0; i < vectors; i += 16) {
+		uint8x16x3_t rgb;
+		rgb.val[0] = vld1q_u8(rgb_planes[0] + i);
+		rgb.val[1] = vld1q_u8(rgb_planes[1] + i);
+		rgb.val[2] = vld1q_u8(rgb_planes[2] + i);
+		vst3q_u8(dst + i * 3, rgb);
+	}
+
+	tone_pack_c(r + vectors, g + vectors, b + vectors, count - vectors, lut, dst + vectors * 3);
+}
+
+static void
+tone_pack_xrgb_neon(const uint8_t *r, const uint8_t *g, const uint8_t *b, int count, const QuickDebayerLut *lut, uint8_t *dst)
+{
+	int vectors = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	vectors = count & ~15;
+	uint8_t rgb_planes[3][CHUNK];
+	lookup_neon(r, vectors, lut->r, rgb_planes[0]);
+	lookup_neon(g, vectors, lut->g, rgb_planes[1]);
+	lookup_neon(b, vectors, lut->b, rgb_planes[2]);
+
+	// 0xffRRGGBB is stored as B, G, R, 0xff
+	for (int i = 0; i < vectors; i += 16) {
+		uint8x16x4_t bgrx;
+		bgrx.val[0] = vld1q_u8(rgb_planes[2] + i);
+		bgrx.val[1] = vld1q_u8(rgb_planes[1] + i);
+		bgrx.val[2] = vld1q_u8(rgb_planes[0] + i);
+		bgrx.val[3] = vdupq_n_u8(0xff);
+		vst4q_u8(dst + i * 4, bgrx);
+	}
+#endif
+
+	tone_pack_xrgb_c(r + vectors, g + vectors, b + vectors, count - vectors, lut, dst + vectors * 4);
+}
+
+static void
+row_sum_neon(const uint8_t *src, int stride, int rows, int count, uint16_t *dst)
+{
+	int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		uint8x16_t v = vld1q_u8(src + i);
+		uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+		uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+		for (int r = 1; r < rows; ++r) {
+			v = vld1q_u8(src + r * stride + i);
+			lo = vaddw_u8(lo, vget_low_u8(v));
+			hi = vaddw_u8(hi, vget_high_u8(v));
+		}
+		vst1q_u16(dst + i, lo);
+		vst1q_u16(dst + i + 8, hi);
+	}
+
+	row_sum_c(src + i, stride, rows, count - i, dst + i);
+}
+
+static void
+bin_neon(const uint16_t *sums, int skip, int count, uint16_t *even, uint16_t *odd)
+{
+	int i = 0;
+	if (skip == 1) {
+		for (; i + 8 <= count; i += 8) {
+			uint16x8x2_t v = vld2q_u16(sums + i * 2);
+			vst1q_u16(even + i, v.val[0]);
+			vst1q_u16(odd + i, v.val[1]);
+		}
+	} else if (skip == 2) {
+		for (; i + 8 <= count; i += 8) {
+			uint16x8x4_t v = vld4q_u16(sums + i * 4);
+			vst1q_u16(even + i, vaddq_u16(v.val[0], v.val[2]));
+			vst1q_u16(odd + i, vaddq_u16(v.val[1], v.val[3]));
+		}
+	} else if (skip == 3) {
+		// Deinterleave the (even, odd) pairs as 32-bit values, the 16-bit
+		// halves can be added without carrying into each other
+		for (; i + 8 <= count; i += 8) {
+			const uint32_t *p = (const uint32_t *)(sums + i * 6);
+			uint32x4x3_t a = vld3q_u32(p);
+			uint32x4x3_t b = vld3q_u32(p + 12);
+			uint16x8_t sa = vaddq_u16(vreinterpretq_u16_u32(a.val[0]),
+				vaddq_u16(vreinterpretq_u16_u32(a.val[1]), vreinterpretq_u16_u32(a.val[2])));
+			uint16x8_t sb = vaddq_u16(vreinterpretq_u16_u32(b.val[0]),
+				vaddq_u16(vreinterpretq_u16_u32(b.val[1]), vreinterpretq_u16_u32(b.val[2])));
+			uint16x8x2_t eo = vuzpq_u16(sa, sb);
+			vst1q_u16(even + i, eo.val[0]);
+			vst1q_u16(odd + i, eo.val[1]);
+		}
+	}
+
+	bin_c(sums + i * skip * 2, skip, count - i, even + i, odd + i);
+}
+
+static void
+average_neon(const uint16_t *a, const uint16_t *b, int count, uint16_t bias, uint16_t recip, uint8_t *dst)
+{
+	const uint16x8_t vbias = vdupq_n_u16(bias);
+	const uint16x4_t vrecip = vdup_n_u16(recip);
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		uint16x8_t sum = vaddq_u16(vaddq_u16(vld1q_u16(a + i), vld1q_u16(b + i)), vbias);
+		uint16x4_t lo = vshrn_n_u32(vmull_u16(vget_low_u16(sum), vrecip), 16);
+		uint16x4_t hi = vshrn_n_u32(vmull_u16(vget_high_u16(sum), vrecip), 16);
+		vst1_u8(dst + i, vmovn_u16(vcombine_u16(lo, hi)));
+	}
+
+	average_c(a + i, b + i, count - i, bias, recip, dst + i);
+}
+
+static inline uint8x8_t
+matrix_row_neon(int16x8_t r, int16x8_t g, int16x8_t b, const int16_t *m)
+{
+	int32x4_t lo = vmull_n_s16(vget_low_s16(r), m[0]);
+	int32x4_t hi = vmull_n_s16(vget_high_s16(r), m[0]);
+	lo = vmlal_n_s16(lo, vget_low_s16(g), m[1]);
+	hi = vmlal_n_s16(hi, vget_high_s16(g), m[1]);
+	lo = vmlal_n_s16(lo, vget_low_s16(b), m[2]);
+	hi = vmlal_n_s16(hi, vget_high_s16(b), m[2]);
+	int16x8_t out = vcombine_s16(vqrshrn_n_s32(lo, MATRIX_BITS), vqrshrn_n_s32(hi, MATRIX_BITS));
+	return vqmovun_s16(out);
+}
+
+static void
+matrix_neon(uint8_t *r, uint8_t *g, uint8_t *b, int count, const QuickDebayerLut *lut)
+{
+	const uint8x8_t black = vdup_n_u8(lut->blacklevel);
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		int16x8_t vr = vreinterpretq_s16_u16(vmovl_u8(vqsub_u8(vld1_u8(r + i), black)));
+		int16x8_t vg = vreinterpretq_s16_u16(vmovl_u8(vqsub_u8(vld1_u8(g + i), black)));
+		int16x8_t vb = vreinterpretq_s16_u16(vmovl_u8(vqsub_u8(vld1_u8(b + i), black)));
+		vst1_u8(r + i, matrix_row_neon(vr, vg, vb, lut->matrix + 0));
+		vst1_u8(g + i, matrix_row_neon(vr, vg, vb, lut->matrix + 3));
+		vst1_u8(b + i, matrix_row_neon(vr, vg, vb, lut->matrix + 6));
+	}
+
+	matrix_c(r + i, g + i, b + i, count - i, lut);
+}
+
+static void
+unpack16_neon(const uint8_t *src, int count, int shift, uint8_t *dst)
+{
+	// Deinterleave the low and high bytes and glue the top bits together,
+	// which doesn't depend on the byte order of the CPU
+	int8x16_t low_shift = vdupq_n_s8(-shift);
+	int8x16_t high_shift = vdupq_n_s8(8 - shift);
+	int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		uint8x16x2_t v = vld2q_u8(src + i * 2);
+		vst1q_u8(dst + i, vorrq_u8(vshlq_u8(v.val[0], low_shift), vshlq_u8(v.val[1], high_shift)));
+	}
+
+	unpack16_c(src + i * 2, count - i, shift, dst + i);
+}
+
+static void
+unpack_packed_neon(const uint8_t *src, const uint8_t *end, int group, int samples, int count, uint8_t *dst)
+{
+	uint8x16_t mask = vld1q_u8(unpack_masks[group == 5]);
+	int groups = 16 / group;
+	int i = 0;
+#ifdef __aarch64__
+	for (; i + groups <= count && src + i * group + 16 <= end; i += groups) {
+		vst1q_u8(dst + i * samples, vqtbl1q_u8(vld1q_u8(src + i * group), mask));
+	}
+#else
+	for (; i + groups <= count && src + i * group + 16 <= end; i += groups) {
+		uint8x16_t v = vld1q_u8(src + i * group);
+		uint8x8x2_t table = { { vget_low_u8(v), vget_high_u8(v) } };
+		vst1q_u8(dst + i * samples, vcombine_u8(
+			vtbl2_u8(table, vget_low_u8(mask)),
+			vtbl2_u8(table, vget_high_u8(mask))));
+	}
+#endif
+
+	unpack_packed_c(src + i * group, end, group, samples, count - i, dst + i * samples);
+}
+
+static const struct debayer_ops ops_neon = {
+	.supported = supported_neon,
+	.gather = gather_neon,
+	.tone_pack = tone_pack_neon,
+	.tone_pack_xrgb = tone_pack_xrgb_neon,
+	.row_sum = row_sum_neon,
+	.bin = bin_neon,
+	.average = average_neon,
+	.matrix = matrix_neon,
+	.unpack16 = unpack16_neon,
+	.unpack_packed = unpack_packed_neon,
+};
+
+#endif
+
+static const char *impl_names[QUICK_DEBAYER_IMPL_MAX] = {
+	"auto",
+	"c",
+	"sse2",
+	"avx2",
+	"neon",
+};
+
+static const struct debayer_ops *impl_ops[QUICK_DEBAYER_IMPL_MAX] = {
+	[QUICK_DEBAYER_IMPL_C] = &ops_c,
+#ifdef HAVE_X86
+	[QUICK_DEBAYER_IMPL_SSE2] = &ops_sse2,
+	[QUICK_DEBAYER_IMPL_AVX2] = &ops_avx2,
+#endif
+#ifdef HAVE_NEON
+	[QUICK_DEBAYER_IMPL_NEON] = &ops_neon,
+#endif
+};
+
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+static bool impl_supported[QUICK_DEBAYER_IMPL_MAX];
+static QuickDebayerImpl best_impl = QUICK_DEBAYER_IMPL_C;
+static QuickDebayerImpl current_impl = QUICK_DEBAYER_IMPL_AUTO;
+
+static void
+init_impls()
+{
+	quick_debayer_lut_init(&default_lut, 0, 255, NULL);
+	init_unpack_masks();
+
+#ifdef HAVE_X86
+	init_avx2_masks();
+#endif
+
+	// Later entries in the enum are preferred
+	for (QuickDebayerImpl impl = QUICK_DEBAYER_IMPL_C; impl < QUICK_DEBAYER_IMPL_MAX; ++impl) {
+		impl_supported[impl] = impl_ops[impl] && impl_ops[impl]->supported();
+		if (impl_supported[impl]) {
+			best_impl = impl;
+		}
+	}
+	impl_supported[QUICK_DEBAYER_IMPL_AUTO] = true;
+}
+
+const char *
+quick_debayer_impl_name(QuickDebayerImpl impl)
+{
+	if (impl >= QUICK_DEBAYER_IMPL_MAX) {
+		return "invalid";
+	}
+	return impl_names[impl];
+}
+
+static const char *mode_names[QUICK_DEBAYER_MODE_MAX] = {
+	"skip",
+	"bin",
+};
+
+const char *
+quick_debayer_mode_name(QuickDebayerMode mode)
+{
+	if (mode >= QUICK_DEBAYER_MODE_MAX) {
+		return "invalid";
+	}
+	return mode_names[mode];
+}
+
+QuickDebayerMode
+quick_debayer_mode_from_str(const char *str)
+{
+	for (QuickDebayerMode mode = 0; mode < QUICK_DEBAYER_MODE_MAX; ++mode) {
+		if (strcmp(mode_names[mode], str) == 0) {
+			return mode;
+		}
+	}
+	return QUICK_DEBAYER_MODE_MAX;
+}
+
+bool
+quick_debayer_impl_supported(QuickDebayerImpl impl)
+{
+	pthread_once(&impl_once, init_impls);
+	return impl < QUICK_DEBAYER_IMPL_MAX && impl_supported[impl];
+}
+
+bool
+quick_debayer_set_impl(QuickDebayerImpl impl)
+{
+	if (!quick_debayer_impl_supported(impl)) {
+		return false;
+	}
+	current_impl = impl;
+	return true;
+}
+
+QuickDebayerImpl
+quick_debayer_get_impl()
+{
+	pthread_once(&impl_once, init_impls);
+	return current_impl == QUICK_DEBAYER_IMPL_AUTO ? best_impl : current_impl;
+}
+
+// Position of each colour in the 2x2 bayer cell, as row * 2 + column
+struct cfa_order {
+	uint8_t r;
+	uint8_t g;
+	uint8_t b;
+};
+
+enum cfa {
+	CFA_BGGR,
+	CFA_GBRG,
+	CFA_GRBG,
+	CFA_RGGB,
+
+	CFA_MAX,
+};
+
+static const struct cfa_order cfa_orders[CFA_MAX] = {
+	// B G
+	// G R
+	[CFA_BGGR] = { .r = 3, .g = 1, .b = 0 },
+	// G B
+	// R G
+	[CFA_GBRG] = { .r = 2, .g = 0, .b = 1 },
+	// G R
+	// B G
+	[CFA_GRBG] = { .r = 1, .g = 0, .b = 2 },
+	// R G
+	// G B
+	[CFA_RGGB] = { .r = 0, .g = 1, .b = 3 },
+};
+
+// How the samples of a row are stored
+enum raw_packing {
+	RAW_8,
+	// 16-bit little endian words
+	RAW_16,
+	// MIPI packing, the top 8 bits of every sample followed by a byte of
+	// low bits for every 4 samples for 10-bit and every 2 for 12-bit
+	RAW_10P,
+	RAW_12P,
+};
+
+struct raw_format {
+	enum cfa cfa;
+	enum raw_packing packing;
+	// Significant bits of every sample, 0 for unsupported formats
+	int bits;
+};
+
+static const struct raw_format raw_formats[MP_PIXEL_FMT_MAX] = {
+	[MP_PIXEL_FMT_BGGR8] = { CFA_BGGR, RAW_8, 8 },
+	[MP_PIXEL_FMT_GBRG8] = { CFA_GBRG, RAW_8, 8 },
+	[MP_PIXEL_FMT_GRBG8] = { CFA_GRBG, RAW_8, 8 },
+	[MP_PIXEL_FMT_RGGB8] = { CFA_RGGB, RAW_8, 8 },
+	[MP_PIXEL_FMT_BGGR10] = { CFA_BGGR, RAW_16, 10 },
+	[MP_PIXEL_FMT_GBRG10] = { CFA_GBRG, RAW_16, 10 },
+	[MP_PIXEL_FMT_GRBG10] = { CFA_GRBG, RAW_16, 10 },
+	[MP_PIXEL_FMT_RGGB10] = { CFA_RGGB, RAW_16, 10 },
+	[MP_PIXEL_FMT_BGGR12] = { CFA_BGGR, RAW_16, 12 },
+	[MP_PIXEL_FMT_GBRG12] = { CFA_GBRG, RAW_16, 12 },
+	[MP_PIXEL_FMT_GRBG12] = { CFA_GRBG, RAW_16, 12 },
+	[MP_PIXEL_FMT_RGGB12] = { CFA_RGGB, RAW_16, 12 },
+	[MP_PIXEL_FMT_BGGR10P] = { CFA_BGGR, RAW_10P, 10 },
+	[MP_PIXEL_FMT_GBRG10P] = { CFA_GBRG, RAW_10P, 10 },
+	[MP_PIXEL_FMT_GRBG10P] = { CFA_GRBG, RAW_10P, 10 },
+	[MP_PIXEL_FMT_RGGB10P] = { CFA_RGGB, RAW_10P, 10 },
+	[MP_PIXEL_FMT_BGGR12P] = { CFA_BGGR, RAW_12P, 12 },
+	[MP_PIXEL_FMT_GBRG12P] = { CFA_GBRG, RAW_12P, 12 },
+	[MP_PIXEL_FMT_GRBG12P] = { CFA_GRBG, RAW_12P, 12 },
+	[MP_PIXEL_FMT_RGGB12P] = { CFA_RGGB, RAW_12P, 12 },
+};
+
+static const struct raw_format *
+get_raw_format(MPPixelFormat format)
+{
+	if (format >= MP_PIXEL_FMT_MAX || raw_formats[format].bits == 0) {
+		return NULL;
+	}
+	return &raw_formats[format];
+}
+
+// Bytes in a source row
+static int
+raw_row_bytes(const struct raw_format *raw, int width)
+{
+	switch (raw->packing) {
+		case RAW_16:
+			return width * 2;
+		case RAW_10P:
+			return width / 4 * 5;
+		case RAW_12P:
+			return width / 2 * 3;
+		default:
+			return width;
+	}
+}
+
+// Unpack the top 8 bits of the columns first_column up to last_column of rows
+// source rows, starting at first_row, into the same columns of rows of width
+// bytes in dst
+static void
+unpack_rows(const struct debayer_ops *ops, const struct raw_format *raw, const uint8_t *source, const uint8_t *end, int width, int first_row, int rows, int first_column, int last_column, uint8_t *dst)
+{
+	int row_bytes = raw_row_bytes(raw, width);
+
+	for (int i = 0; i < rows; ++i) {
+		const uint8_t *src = source + (first_row + i) * row_bytes;
+		uint8_t *row = dst + i * width;
+
+		if (raw->packing == RAW_16) {
+			ops->unpack16(src + first_column * 2, last_column - first_column, raw->bits - 8, row + first_column);
+		} else {
+			// Whole groups only
+			int samples = raw->packing == RAW_10P ? 4 : 2;
+			int group = samples + 1;
+			int first = first_column / samples;
+			int last = (last_column + samples - 1) / samples;
+			if (last > width / samples) {
+				last = width / samples;
+			}
+			ops->unpack_packed(src + first * group, end, group, samples, last - first, row + first * samples);
+		}
+	}
+}
+
+static int
+normalize_rotation(int rotation)
+{
+	rotation %= 360;
+	if (rotation < 0) {
+		rotation += 360;
+	}
+	return rotation % 90 == 0 ? rotation : 0;
+}
+
+static bool
+is_scaled(const QuickDebayerParams *params)
+{
+	return params->dest_width > 0 && params->dest_height > 0;
+}
+
+// Size of the output before rotation
+static void
+get_unrotated_size(const QuickDebayerParams *params, int *width, int *height)
+{
+	if (is_scaled(params)) {
+		int rotation = normalize_rotation(params->rotation);
+		if (rotation == 90 || rotation == 270) {
+			*width = params->dest_height;
+			*height = params->dest_width;
+		} else {
+			*width = params->dest_width;
+			*height = params->dest_height;
+		}
+	} else {
+		*width = params->width / (2 * params->skip);
+		*height = params->height / (2 * params->skip);
+	}
+}
+
+void
+quick_debayer_get_size(const QuickDebayerParams *params, int *width, int *height)
+{
+	if (is_scaled(params)) {
+		*width = params->dest_width;
+		*height = params->dest_height;
+		return;
+	}
+
+	int step = 2 * params->skip;
+	int rotation = normalize_rotation(params->rotation);
+	if (rotation == 90 || rotation == 270) {
+		*width = params->height / step;
+		*height = params->width / step;
+	} else {
+		*width = params->width / step;
+		*height = params->height / step;
+	}
+}
+
+// Scale factors are in bayer cells per output pixel, as 16.16 fixed point
+#define SCALE_BITS 16
+
+static inline uint32_t
+scale_step(int cells, int size)
+{
+	return (uint32_t)(((uint64_t)cells << SCALE_BITS) / size);
+}
+
+// Bayer cell under the centre of output pixel i
+static inline int
+scale_index(uint32_t step, int i)
+{
+	return (int)(((uint64_t)step * i + step / 2) >> SCALE_BITS);
+}
+
+// Copy a tile of packed pixels into the destination, rotated counter
+// clockwise. x and y are the position of the tile in the unrotated output.
+// Only called with a constant pixel size so the copies become single moves.
+static inline __attribute__((always_inline)) void
+store_tile(const uint8_t *tile, int columns, int rows, int x, int y, int out_width, int out_height, int rotation, uint8_t *destination, int stride, int bpp)
+{
+	switch (rotation) {
+		case 90:
+			for (int i = 0; i < columns; ++i) {
+				uint8_t *dst = destination + (out_width - 1 - x - i) * stride + y * bpp;
+				for (int t = 0; t < rows; ++t) {
+					memcpy(dst + t * bpp, tile + (t * columns + i) * bpp, bpp);
+				}
+			}
+			break;
+		case 180:
+			for (int t = 0; t < rows; ++t) {
+				uint8_t *dst = destination + (out_height - 1 - y - t) * stride + (out_width - x - columns) * bpp;
+				const uint8_t *src = tile + t * columns * bpp;
+				for (int i = 0; i < columns; ++i) {
+					memcpy(dst + (columns - 1 - i) * bpp, src + i * bpp, bpp);
+				}
+			}
+			break;
+		case 270:
+			for (int i = 0; i < columns; ++i) {
+				uint8_t *dst = destination + (x + i) * stride + (out_height - y - rows) * bpp;
+				for (int t = 0; t < rows; ++t) {
+					memcpy(dst + t * bpp, tile + ((rows - 1 - t) * columns + i) * bpp, bpp);
+				}
+			}
+			break;
+	}
+}
+
+// Average every colour over the whole block of skip x skip bayer cells
+// instead of picking a single sample, which is what makes skipping alias
+static inline void
+bin_planes(const struct debayer_ops *ops, const struct cfa_order *order, const uint8_t *src, int width, int skip, int count, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+	uint16_t sums[CHUNK * BIN_MAX_SKIP * 2 + BIN_PADDING];
+	uint16_t cells[4][CHUNK];
+
+	int columns = count * skip * 2;
+	memset(sums + columns, 0, BIN_PADDING * sizeof(uint16_t));
+
+	// Even source rows hold cell positions 0 and 1, odd rows 2 and 3
+	for (int row = 0; row < 2; ++row) {
+		ops->row_sum(src + row * width, width * 2, skip, columns, sums);
+		ops->bin(sums, skip, count, cells[row * 2], cells[row * 2 + 1]);
+	}
+
+	// Red and blue are counted twice so all channels share the divisor of
+	// the two greens
+	uint16_t samples = 2 * skip * skip;
+	uint16_t recip = (65536 + samples - 1) / samples;
+	uint16_t bias = samples / 2;
+	ops->average(cells[order->r], cells[order->r], count, bias, recip, r);
+	ops->average(cells[order->g], cells[3 - order->g], count, bias, recip, g);
+	ops->average(cells[order->b], cells[order->b], count, bias, recip, b);
+}
+
+// State for sampling the frame at an arbitrary size. Binned frames are
+// sampled from the grid of block x block cell bins, anything else straight
+// from the bayer cells.
+struct scaler {
+	uint32_t x_step;
+	uint32_t y_step;
+	int block;
+	int bins_x;
+	int bins_y;
+};
+
+static void
+scaler_init(struct scaler *scaler, const QuickDebayerParams *params, int out_width, int out_height)
+{
+	int cells_x = params->width / 2;
+	int cells_y = params->height / 2;
+	scaler->x_step = scale_step(cells_x, out_width);
+	scaler->y_step = scale_step(cells_y, out_height);
+
+	// The largest block that fits in an output pixel in both directions
+	uint32_t step = scaler->x_step < scaler->y_step ? scaler->x_step : scaler->y_step;
+	scaler->block = step >> SCALE_BITS;
+	if (scaler->block < 1) {
+		scaler->block = 1;
+	}
+	if (params->mode != QUICK_DEBAYER_MODE_BIN || scaler->block > BIN_MAX_SKIP) {
+		scaler->block = 0;
+	}
+
+	if (scaler->block) {
+		scaler->bins_x = cells_x / scaler->block;
+		scaler->bins_y = cells_y / scaler->block;
+	}
+}
+
+// Index of the bin under the centre of output pixel i
+static inline int
+scaler_bin(uint32_t step, int block, int bins, int i)
+{
+	int bin = scale_index(step, i) / block;
+	return bin < bins ? bin : bins - 1;
+}
+
+// Column table for count output pixels starting at x: byte offsets of the
+// bayer cells, or bin indices when binning
+static inline void
+scaler_columns(const struct scaler *scaler, int x, int count, int *columns)
+{
+	if (scaler->block) {
+		for (int i = 0; i < count; ++i) {
+			columns[i] = scaler_bin(scaler->x_step, scaler->block, scaler->bins_x, x + i);
+		}
+	} else {
+		for (int i = 0; i < count; ++i) {
+			columns[i] = scale_index(scaler->x_step, x + i) * 2;
+		}
+	}
+}
+
+// First source row the output row y is sampled from
+static inline int
+scaler_row(const struct scaler *scaler, int y)
+{
+	if (scaler->block) {
+		return scaler_bin(scaler->y_step, scaler->block, scaler->bins_y, y) * scaler->block * 2;
+	}
+	return scale_index(scaler->y_step, y) * 2;
+}
+
+// Sample count output pixels through the column table, src points at the
+// first row returned by scaler_row
+static inline void
+scale_planes(const struct debayer_ops *ops, const struct cfa_order *order, const struct scaler *scaler, const int *columns, const uint8_t *src, int width, int count, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+	if (!scaler->block) {
+		const uint8_t *src_r = src + (order->r / 2) * width + order->r % 2;
+		const uint8_t *src_g = src + (order->g / 2) * width + order->g % 2;
+		const uint8_t *src_b = src + (order->b / 2) * width + order->b % 2;
+
+		for (int i = 0; i < count; ++i) {
+			r[i] = src_r[columns[i]];
+			g[i] = src_g[columns[i]];
+			b[i] = src_b[columns[i]];
+		}
+		return;
+	}
+
+	int block = scaler->block;
+
+	// Bin the runs of neighbouring bins the pixels fall in, at most CHUNK
+	// at a time, and pick the sampled ones out of them
+	uint8_t bins[3][CHUNK];
+	for (int i = 0; i < count;) {
+		int first = columns[i];
+		int last = i;
+		while (last + 1 < count && columns[last + 1] - first < CHUNK) {
+			++last;
+		}
+
+		bin_planes(ops, order, src + first * block * 2, width, block, columns[last] - first + 1, bins[0], bins[1], bins[2]);
+
+		for (; i <= last; ++i) {
+			r[i] = bins[0][columns[i] - first];
+			g[i] = bins[1][columns[i] - first];
+			b[i] = bins[2][columns[i] - first];
+		}
+	}
+}
+
+// Rows of deeper formats are unpacked into a buffer per thread, so the bands of
+// the pool workers don't allocate for every frame. Freed when the thread exits.
+static pthread_once_t unpack_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t unpack_key;
+static _Thread_local uint8_t *unpack_buffer = NULL;
+static _Thread_local size_t unpack_buffer_size = 0;
+
+static void
+init_unpack_key()
+{
+	pthread_key_create(&unpack_key, free);
+}
+
+static uint8_t *
+get_unpack_buffer(size_t size)
+{
+	if (size > unpack_buffer_size) {
+		pthread_once(&unpack_key_once, init_unpack_key);
+		free(unpack_buffer);
+		unpack_buffer = calloc(1, size);
+		unpack_buffer_size = size;
+		pthread_setspecific(unpack_key, unpack_buffer);
+	}
+	return unpack_buffer;
+}
+
+// Debayer the rows first_row up to last_row of the unrotated output. Only ever
+// called with a constant order, so every variant gets its own copy with fixed
+// channel offsets
+static inline __attribute__((always_inline)) void
+debayer(const struct cfa_order *order, const struct raw_format *raw, const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params, int first_row, int last_row)
+{
+	const struct debayer_ops *ops = impl_ops[quick_debayer_get_impl()];
+
+	int width = params->width;
+	int step = 2 * params->skip;
+	int out_width, out_height;
+	get_unrotated_size(params, &out_width, &out_height);
+	const uint8_t *source_end = source + raw_row_bytes(raw, width) * params->height;
+
+	bool scaled = is_scaled(params);
+	struct scaler scaler;
+	if (scaled) {
+		scaler_init(&scaler, params, out_width, out_height);
+	}
+
+	bool binning = params->mode == QUICK_DEBAYER_MODE_BIN && params->skip <= BIN_MAX_SKIP;
+
+	// Number of source rows every output row is made from
+	int window = 2;
+	if (scaled && scaler.block) {
+		window = 2 * scaler.block;
+	} else if (!scaled && binning) {
+		window = 2 * params->skip;
+	}
+
+	// Deeper formats are unpacked to 8-bit rows first, just the columns and
+	// rows an output row needs. Everything after that is shared.
+	uint8_t *unpacked = NULL;
+	const uint8_t *end = source_end;
+	if (raw->packing != RAW_8) {
+		unpacked = get_unpack_buffer(window * width + UNPACK_PADDING);
+		end = unpacked + window * width;
+	}
+
+	bool xrgb = params->output == QUICK_DEBAYER_OUTPUT_XRGB8888;
+	int bpp = xrgb ? 4 : 3;
+
+	int rotation = normalize_rotation(params->rotation);
+	int stride = params->stride;
+	if (stride == 0) {
+		stride = (rotation == 90 || rotation == 270 ? out_height : out_width) * bpp;
+	}
+
+	int r_offset = (order->r / 2) * width + order->r % 2;
+	int g_offset = (order->g / 2) * width + order->g % 2;
+	int b_offset = (order->b / 2) * width + order->b % 2;
+
+	const QuickDebayerLut *lut = params->lut ? params->lut : &default_lut;
+
+	uint8_t r[CHUNK], g[CHUNK], b[CHUNK];
+	uint8_t tile[TILE_ROWS * CHUNK * 4] __attribute__((aligned(16)));
+
+	// Work in tiles so the rotated writes hit the same few cache lines
+	// while the tile is being stored
+	if (last_row > out_height) {
+		last_row = out_height;
+	}
+
+	for (int y = first_row; y < last_row; y += TILE_ROWS) {
+		int rows = last_row - y < TILE_ROWS ? last_row - y : TILE_ROWS;
+
+		for (int x = 0; x < out_width; x += CHUNK) {
+			int count = out_width - x < CHUNK ? out_width - x : CHUNK;
+
+			// Source columns the chunk is made from
+			int columns[CHUNK];
+			int first_column, last_column;
+			if (scaled) {
+				scaler_columns(&scaler, x, count, columns);
+				if (scaler.block) {
+					first_column = columns[0] * scaler.block * 2;
+					last_column = (columns[count - 1] + 1) * scaler.block * 2;
+				} else {
+					first_column = columns[0];
+					last_column = columns[count - 1] + 2;
+				}
+			} else {
+				first_column = x * step;
+				last_column = binning ? (x + count) * step : (x + count - 1) * step + 2;
+			}
+
+			for (int t = 0; t < rows; ++t) {
+				int source_row = scaled ? scaler_row(&scaler, y + t) : (y + t) * step;
+
+				const uint8_t *window_src;
+				if (unpacked) {
+					unpack_rows(ops, raw, source, source_end, width, source_row, window, first_column, last_column, unpacked);
+					window_src = unpacked;
+				} else {
+					window_src = source + source_row * width;
+				}
+
+				const uint8_t *src = window_src + x * step;
+
+				if (scaled) {
+					scale_planes(ops, order, &scaler, columns, window_src, width, count, r, g, b);
+				} else if (binning) {
+					bin_planes(ops, order, src, width, params->skip, count, r, g, b);
+				} else {
+					ops->gather(src + r_offset, end, step, count, r);
+					ops->gather(src + g_offset, end, step, count, g);
+					ops->gather(src + b_offset, end, step, count, b);
+				}
+
+				uint8_t *dst;
+				if (rotation == 0) {
+					dst = destination + (y + t) * stride + x * bpp;
+				} else {
+					dst = tile + t * count * bpp;
+				}
+				if (lut->use_matrix) {
+					ops->matrix(r, g, b, count, lut);
+				}
+				if (xrgb) {
+					ops->tone_pack_xrgb(r, g, b, count, lut, dst);
+				} else {
+					ops->tone_pack(r, g, b, count, lut, dst);
+				}
+			}
+
+			if (rotation != 0 && xrgb) {
+				store_tile(tile, count, rows, x, y, out_width, out_height, rotation, destination, stride, 4);
+			} else if (rotation != 0) {
+				store_tile(tile, count, rows, x, y, out_width, out_height, rotation, destination, stride, 3);
+			}
+		}
+	}
+}
+
+typedef void (*debayer_rows_func)(const struct raw_format *raw, const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params, int first_row, int last_row);
+
+static void
+debayer_rows_bggr(const struct raw_format *raw, const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params, int first_row, int last_row)
+{
+	debayer(&cfa_orders[CFA_BGGR], raw, source, destination, params, first_row, last_row);
+}
+
+static void
+debayer_rows_gbrg(const struct raw_format *raw, const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params, int first_row, int last_row)
+{
+	debayer(&cfa_orders[CFA_GBRG], raw, source, destination, params, first_row, last_row);
+}
+
+static void
+debayer_rows_grbg(const struct raw_format *raw, const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params, int first_row, int last_row)
+{
+	debayer(&cfa_orders[CFA_GRBG], raw, source, destination, params, first_row, last_row);
+}
+
+static void
+debayer_rows_rggb(const struct raw_format *raw, const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params, int first_row, int last_row)
+{
+	debayer(&cfa_orders[CFA_RGGB], raw, source, destination, params, first_row, last_row);
+}
+
+void
+quick_debayer_bggr8(const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params)
+{
+	int width, height;
+	get_unrotated_size(params, &width, &height);
+	debayer_rows_bggr(&raw_formats[MP_PIXEL_FMT_BGGR8], source, destination, params, 0, height);
+}
+
+void
+quick_debayer_gbrg8(const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params)
+{
+	int width, height;
+	get_unrotated_size(params, &width, &height);
+	debayer_rows_gbrg(&raw_formats[MP_PIXEL_FMT_GBRG8], source, destination, params, 0, height);
+}
+
+void
+quick_debayer_grbg8(const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params)
+{
+	int width, height;
+	get_unrotated_size(params, &width, &height);
+	debayer_rows_grbg(&raw_formats[MP_PIXEL_FMT_GRBG8], source, destination, params, 0, height);
+}
+
+void
+quick_debayer_rggb8(const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params)
+{
+	int width, height;
+	get_unrotated_size(params, &width, &height);
+	debayer_rows_rggb(&raw_formats[MP_PIXEL_FMT_RGGB8], source, destination, params, 0, height);
+}
+
+static const debayer_rows_func cfa_rows_funcs[CFA_MAX] = {
+	[CFA_BGGR] = debayer_rows_bggr,
+	[CFA_GBRG] = debayer_rows_gbrg,
+	[CFA_GRBG] = debayer_rows_grbg,
+	[CFA_RGGB] = debayer_rows_rggb,
+};
+
+bool
+quick_debayer_format_supported(MPPixelFormat format)
+{
+	return get_raw_format(format) != NULL;
+}
+
+bool
+quick_debayer(MPPixelFormat format, const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params)
+{
+	const struct raw_format *raw = get_raw_format(format);
+	if (!raw) {
+		return false;
+	}
+
+	int width, height;
+	get_unrotated_size(params, &width, &height);
+	cfa_rows_funcs[raw->cfa](raw, source, destination, params, 0, height);
+	return true;
+}
+
+static const QuickDebayerFunc cfa_funcs[MP_PIXEL_FMT_MAX] = {
+	[MP_PIXEL_FMT_BGGR8] = quick_debayer_bggr8,
+	[MP_PIXEL_FMT_GBRG8] = quick_debayer_gbrg8,
+	[MP_PIXEL_FMT_GRBG8] = quick_debayer_grbg8,
+	[MP_PIXEL_FMT_RGGB8] = quick_debayer_rggb8,
+};
+
+QuickDebayerFunc
+quick_debayer_get_func(MPPixelFormat format)
+{
+	if (format >= MP_PIXEL_FMT_MAX) {
+		return NULL;
+	}
+	return cfa_funcs[format];
+}
+
+bool
+quick_debayer_get_cfa_pattern(MPPixelFormat format, uint8_t pattern[4])
+{
+	const struct raw_format *raw = get_raw_format(format);
+	if (!raw) {
+		return false;
+	}
+
+	// DNG CFAPattern, 0 = red, 1 = green, 2 = blue
+	const struct cfa_order *order = &cfa_orders[raw->cfa];
+	memset(pattern, 1, 4);
+	pattern[order->r] = 0;
+	pattern[order->b] = 2;
+	return true;
+}
+
+// Bands handed out per thread, more than one so a thread that got preempted
+// doesn't hold up the whole frame
+#define BANDS_PER_THREAD 4
+
+struct _QuickDebayerPool {
+	pthread_t *workers;
+	int num_workers;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+
+	// The frame currently being debayered, only changed while no worker is busy
+	debayer_rows_func func;
+	const struct raw_format *raw;
+	const uint8_t *source;
+	uint8_t *destination;
+	QuickDebayerParams params;
+	int rows;
+	int band_rows;
+
+	atomic_int next_band;
+	int busy_workers;
+	unsigned int generation;
+	bool quit;
+};
+
+static void
+run_bands(QuickDebayerPool *pool)
+{
+	int band;
+	while ((band = atomic_fetch_add(&pool->next_band, 1)) * pool->band_rows < pool->rows) {
+		int first_row = band * pool->band_rows;
+		pool->func(pool->raw, pool->source, pool->destination, &pool->params, first_row, first_row + pool->band_rows);
+	}
+}
+
+static void *
+worker_main(void *data)
+{
+	QuickDebayerPool *pool = data;
+	unsigned int generation = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (true) {
+		while (!pool->quit && pool->generation == generation) {
+			pthread_cond_wait(&pool->start_cond, &pool->mutex);
+		}
+		if (pool->quit) {
+			break;
+		}
+		generation = pool->generation;
+		pthread_mutex_unlock(&pool->mutex);
+
+		run_bands(pool);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (--pool->busy_workers == 0) {
+			pthread_cond_signal(&pool->done_cond);
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+QuickDebayerPool *
+quick_debayer_pool_new(int threads)
+{
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads <= 0) {
+		threads = 1;
+	}
+
+	QuickDebayerPool *pool = calloc(1, sizeof(QuickDebayerPool));
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->start_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	// The calling thread works on the frame as well
+	pool->workers = calloc(threads - 1, sizeof(pthread_t));
+	for (int i = 0; i < threads - 1; ++i) {
+		if (pthread_create(&pool->workers[i], NULL, worker_main, pool) != 0) {
+			break;
+		}
+		++pool->num_workers;
+	}
+
+	return pool;
+}
+
+void
+quick_debayer_pool_free(QuickDebayerPool *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (int i = 0; i < pool->num_workers; ++i) {
+		pthread_join(pool->workers[i], NULL);
+	}
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->start_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->workers);
+	free(pool);
+}
+
+int
+quick_debayer_pool_get_threads(const QuickDebayerPool *pool)
+{
+	return pool->num_workers + 1;
+}
+
+bool
+quick_debayer_parallel(QuickDebayerPool *pool, MPPixelFormat format, const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params)
+{
+	const struct raw_format *raw = get_raw_format(format);
+	if (!raw) {
+		return false;
+	}
+
+	int width, rows;
+	get_unrotated_size(params, &width, &rows);
+	int threads = pool->num_workers + 1;
+
+	// Bands are made of whole tiles so only the last one stores a partial tile
+	int band_rows = (rows + threads * BANDS_PER_THREAD - 1) / (threads * BANDS_PER_THREAD);
+	band_rows = (band_rows + TILE_ROWS - 1) / TILE_ROWS * TILE_ROWS;
+
+	if (pool->num_workers == 0 || rows <= band_rows) {
+		cfa_rows_funcs[raw->cfa](raw, source, destination, params, 0, rows);
+		return true;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->func = cfa_rows_funcs[raw->cfa];
+	pool->raw = raw;
+	pool->source = source;
+	pool->destination = destination;
+	pool->params = *params;
+	pool->rows = rows;
+	pool->band_rows = band_rows;
+	atomic_store(&pool->next_band, 0);
+	pool->busy_workers = pool->num_workers;
+	++pool->generation;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	run_bands(pool);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->busy_workers > 0) {
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return true;
 }
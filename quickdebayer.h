@@ -1,4 +1,129 @@
+#pragma once
+
+#include "camera.h"
+
+#include <stdbool.h>
 #include <stdint.h>
 
-void quick_debayer_bggr8(const uint8_t *source, uint8_t *destination, int width, int height, int skip, int blacklevel);
+typedef enum {
+	QUICK_DEBAYER_IMPL_AUTO,
+	QUICK_DEBAYER_IMPL_C,
+	QUICK_DEBAYER_IMPL_SSE2,
+	QUICK_DEBAYER_IMPL_AVX2,
+	QUICK_DEBAYER_IMPL_NEON,
+
+	QUICK_DEBAYER_IMPL_MAX,
+} QuickDebayerImpl;
+
+const char *quick_debayer_impl_name(QuickDebayerImpl impl);
+bool quick_debayer_impl_supported(QuickDebayerImpl impl);
+
+// The best supported implementation is picked on first use, this is only
+// needed to force a specific one, e.g. for benchmarking
+bool quick_debayer_set_impl(QuickDebayerImpl impl);
+QuickDebayerImpl quick_debayer_get_impl();
+
+// Per channel tables mapping raw values straight to the sRGB preview output,
+// with the black and white level and the white balance folded in
+typedef struct {
+	uint8_t r[256];
+	uint8_t g[256];
+	uint8_t b[256];
+
+	// With a colour matrix the raw values minus the black level go through
+	// the matrix first, and the tables only apply the sRGB curve
+	bool use_matrix;
+	uint8_t blacklevel;
+	// Q12 fixed point, one row per output channel
+	int16_t matrix[9];
+} QuickDebayerLut;
+
+// gains are the red, green and blue white balance multipliers, NULL for none
+void quick_debayer_lut_init(QuickDebayerLut *lut, int blacklevel, int whitelevel, const float gains[3]);
+// Same but also converting the colours, matrix maps white balanced camera
+// RGB to linear sRGB and is row major
+void quick_debayer_lut_init_matrix(QuickDebayerLut *lut, int blacklevel, int whitelevel, const float gains[3], const float matrix[9]);
+
+typedef enum {
+	// Take a single sample of every colour per skip x skip block of bayer
+	// cells, fastest but aliases
+	QUICK_DEBAYER_MODE_SKIP,
+	// Average all samples of every colour in the block, skip can be at most
+	// 11 and larger values fall back to skipping
+	QUICK_DEBAYER_MODE_BIN,
+
+	QUICK_DEBAYER_MODE_MAX,
+} QuickDebayerMode;
+
+const char *quick_debayer_mode_name(QuickDebayerMode mode);
+// Returns QUICK_DEBAYER_MODE_MAX for unknown names
+QuickDebayerMode quick_debayer_mode_from_str(const char *str);
+
+typedef enum {
+	// Packed 8-bit red, green and blue, like GdkPixbuf
+	QUICK_DEBAYER_OUTPUT_RGB888,
+	// Native endian 32-bit 0xffRRGGBB words, like CAIRO_FORMAT_RGB24
+	QUICK_DEBAYER_OUTPUT_XRGB8888,
+
+	QUICK_DEBAYER_OUTPUT_MAX,
+} QuickDebayerOutput;
+
+typedef struct {
+	// Size of the source frame
+	int width;
+	int height;
+
+	int skip;
+	QuickDebayerMode mode;
+
+	// Size of the destination image after rotation, 0 to shrink the frame by
+	// 2 * skip. Any other size is sampled through fixed point index tables
+	// and skip is ignored, binning then averages the largest whole block of
+	// bayer cells that fits in a destination pixel.
+	int dest_width;
+	int dest_height;
+
+	// Tone tables, NULL for plain sRGB without black level or white balance
+	const QuickDebayerLut *lut;
+
+	// Counter clockwise rotation in degrees, same as the rotate config option
+	int rotation;
+
+	QuickDebayerOutput output;
+
+	// Bytes between the rows of the destination, 0 for tightly packed rows
+	int stride;
+} QuickDebayerParams;
+
+// Size of the destination image, after rotation
+void quick_debayer_get_size(const QuickDebayerParams *params, int *width, int *height);
+
+typedef void (*QuickDebayerFunc)(const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params);
+
+void quick_debayer_bggr8(const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params);
+void quick_debayer_gbrg8(const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params);
+void quick_debayer_grbg8(const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params);
+void quick_debayer_rggb8(const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params);
+
+// Returns NULL if the format isn't a supported 8-bit bayer format
+QuickDebayerFunc quick_debayer_get_func(MPPixelFormat format);
+
+// Any supported format, including 10 and 12-bit ones. Those are shown with
+// their top 8 bits, so the tone tables take 8-bit levels for every format.
+bool quick_debayer_format_supported(MPPixelFormat format);
+// Returns false if the format isn't supported
+bool quick_debayer(MPPixelFormat format, const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params);
+bool quick_debayer_get_cfa_pattern(MPPixelFormat format, uint8_t pattern[4]);
+
+// Persistent worker threads that debayer horizontal bands of a frame in
+// parallel, the output is identical to the single threaded kernels
+typedef struct _QuickDebayerPool QuickDebayerPool;
+
+// threads includes the calling thread, 0 uses one thread per online CPU
+QuickDebayerPool *quick_debayer_pool_new(int threads);
+void quick_debayer_pool_free(QuickDebayerPool *pool);
+int quick_debayer_pool_get_threads(const QuickDebayerPool *pool);
 
+// Blocks until the whole frame is done. A pool can only run one frame at a
+// time. Returns false if the format isn't a supported bayer format.
+bool quick_debayer_parallel(QuickDebayerPool *pool, MPPixelFormat format, const uint8_t *source, uint8_t *destination, const QuickDebayerParams *params);
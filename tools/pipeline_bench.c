@@ -0,0 +1,191 @@
+#include "pipeline.h"
+#include <gtk/gtk.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#define ROUND_TRIPS 20000
+#define MESSAGES 1000000
+
+// Same size as the frames handed to the process pipeline
+struct message {
+    uint8_t data[32];
+};
+
+static atomic_int pongs;
+static atomic_long received;
+
+static double get_time_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void ping(void *data)
+{
+    atomic_fetch_add(&pongs, 1);
+}
+
+static void receive(void *data)
+{
+    atomic_fetch_add(&received, 1);
+}
+
+// The way mp_pipeline_invoke used to work: a copy of the arguments on the
+// heap, handed to the thread through its main context
+struct glib_thread {
+    GMainContext *main_context;
+    GMainLoop *main_loop;
+    pthread_t thread;
+};
+
+struct glib_args {
+    void (*callback)(void *);
+};
+
+static bool glib_invoke_impl(struct glib_args *args)
+{
+    args->callback(args + 1);
+    return false;
+}
+
+static void glib_invoke(struct glib_thread *thread, void (*callback)(void *), void *data, size_t size)
+{
+    struct glib_args *args = malloc(sizeof(struct glib_args) + size);
+    args->callback = callback;
+    memcpy(args + 1, data, size);
+
+    g_main_context_invoke_full(
+        thread->main_context,
+        G_PRIORITY_DEFAULT,
+        (GSourceFunc)glib_invoke_impl,
+        args,
+        free);
+}
+
+static void *glib_thread_main_loop(void *arg)
+{
+    struct glib_thread *thread = arg;
+
+    g_main_loop_run(thread->main_loop);
+    return NULL;
+}
+
+static void pipeline_ping(MPPipeline *pipeline, void *data)
+{
+    ping(data);
+}
+
+static void pipeline_receive(MPPipeline *pipeline, void *data)
+{
+    receive(data);
+}
+
+struct target {
+    const char *name;
+    MPPipeline *pipeline;
+    struct glib_thread *glib;
+};
+
+static void invoke(struct target *target, void (*callback)(void *), MPPipelineCallback pipeline_callback, void *data, size_t size)
+{
+    if (target->pipeline) {
+        mp_pipeline_invoke(target->pipeline, pipeline_callback, data, size);
+    } else {
+        glib_invoke(target->glib, callback, data, size);
+    }
+}
+
+// Time from invoking until the callback has run, one message at a time
+static void bench_round_trip(struct target *target, bool first)
+{
+    double *samples = malloc(sizeof(double) * ROUND_TRIPS);
+    struct message message = {};
+
+    atomic_store(&pongs, 0);
+    for (int i = 0; i < ROUND_TRIPS; ++i) {
+        double start = get_time_ns();
+        invoke(target, ping, pipeline_ping, &message, sizeof(struct message));
+        while (atomic_load(&pongs) == i) {
+        }
+        samples[i] = get_time_ns() - start;
+    }
+    qsort(samples, ROUND_TRIPS, sizeof(double), compare_doubles);
+
+    printf("%s    { \"path\": \"%s\", \"median_ns\": %.0f, \"p95_ns\": %.0f, \"p99_ns\": %.0f }",
+           first ? "" : ",\n",
+           target->name,
+           samples[ROUND_TRIPS / 2],
+           samples[ROUND_TRIPS * 95 / 100],
+           samples[ROUND_TRIPS * 99 / 100]);
+
+    free(samples);
+}
+
+// Messages per second while invoking as fast as possible
+static void bench_throughput(struct target *target, bool first)
+{
+    struct message message = {};
+
+    atomic_store(&received, 0);
+    double start = get_time_ns();
+    for (int i = 0; i < MESSAGES; ++i) {
+        invoke(target, receive, pipeline_receive, &message, sizeof(struct message));
+    }
+    double sent = get_time_ns();
+    while (atomic_load(&received) < MESSAGES) {
+        sched_yield();
+    }
+    double end = get_time_ns();
+
+    printf("%s    { \"path\": \"%s\", \"messages_per_s\": %.0f, \"invoke_ns\": %.1f }",
+           first ? "" : ",\n",
+           target->name,
+           MESSAGES / (end - start) * 1e9,
+           (sent - start) / MESSAGES);
+}
+
+int main(int argc, char *argv[]) {
+    struct glib_thread glib = {
+        .main_context = g_main_context_new(),
+    };
+    glib.main_loop = g_main_loop_new(glib.main_context, false);
+    pthread_create(&glib.thread, NULL, glib_thread_main_loop, &glib);
+
+    struct target targets[] = {
+        { .name = "glib", .glib = &glib },
+        { .name = "ring", .pipeline = mp_pipeline_new() },
+    };
+    int num_targets = sizeof(targets) / sizeof(targets[0]);
+
+    printf("{\n");
+    printf("  \"round_trip\": [\n");
+    for (int i = 0; i < num_targets; ++i) {
+        bench_round_trip(&targets[i], i == 0);
+    }
+    printf("\n  ],\n");
+    printf("  \"throughput\": [\n");
+    for (int i = 0; i < num_targets; ++i) {
+        bench_throughput(&targets[i], i == 0);
+    }
+    printf("\n  ]\n");
+    printf("}\n");
+
+    mp_pipeline_free(targets[1].pipeline);
+    g_main_loop_quit(glib.main_loop);
+    g_main_context_wakeup(glib.main_context);
+    pthread_join(glib.thread, NULL);
+
+    return 0;
+}
@@ -1,42 +1,588 @@
 #include "quickdebayer.h"
-#include <sys/resource.h>
-#include <sys/time.h>
+#include "ini.h"
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glob.h>
 #include <time.h>
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 
-#define WIDTH 2592
-#define HEIGHT 1944
-#define SCALE 2
+#define MAX_RESOLUTIONS 16
+#define MAX_SKIP 4
 #define BLACKLEVEL 0
-#define BENCH_COUNT 10
 
-double get_time()
+// The size previews are usually sampled to
+#define SCALED_WIDTH 720
+#define SCALED_HEIGHT 540
+
+struct resolution {
+    int width;
+    int height;
+};
+
+// The sensor modes of the shipped configs, for when none can be read
+static const struct resolution default_resolutions[] = {
+    { 2592, 1944 },
+    { 1280, 960 },
+};
+
+static struct resolution resolutions[MAX_RESOLUTIONS];
+static int num_resolutions = 0;
+
+static int iterations = 15;
+static int warmup = 3;
+
+// Every bayer order at 8 bits, and every depth and packing in one order. The
+// order doesn't change how rows are unpacked.
+static const MPPixelFormat formats[] = {
+    MP_PIXEL_FMT_BGGR8,
+    MP_PIXEL_FMT_GBRG8,
+    MP_PIXEL_FMT_GRBG8,
+    MP_PIXEL_FMT_RGGB8,
+    MP_PIXEL_FMT_BGGR10,
+    MP_PIXEL_FMT_BGGR10P,
+    MP_PIXEL_FMT_BGGR12,
+    MP_PIXEL_FMT_BGGR12P,
+};
+
+static const char *output_names[QUICK_DEBAYER_OUTPUT_MAX] = {
+    "rgb",
+    "xrgb",
+};
+
+// Plain tone tables, and the colour matrix stage of preview-matrix=1
+#define NUM_LUTS 2
+static const char *lut_names[NUM_LUTS] = {
+    "plain",
+    "matrix",
+};
+
+static void add_resolution(int width, int height)
 {
-    struct timeval t;
-    struct timezone tzp;
-    gettimeofday(&t, &tzp);
-    return t.tv_sec + t.tv_usec*1e-6;
+    for (int i = 0; i < num_resolutions; ++i) {
+        if (resolutions[i].width == width && resolutions[i].height == height) {
+            return;
+        }
+    }
+    if (num_resolutions < MAX_RESOLUTIONS) {
+        resolutions[num_resolutions].width = width;
+        resolutions[num_resolutions].height = height;
+        ++num_resolutions;
+    }
 }
 
-int main(int argc, char *argv[]) {
-    srand(time(NULL));
+// Collects the width and height of every camera section
+static int config_ini_handler(void *user, const char *section, const char *name, const char *value)
+{
+    static char current[64];
+    static int width = 0;
+    static int height = 0;
 
-    size_t size = WIDTH * HEIGHT * 2;
-    uint8_t *buf = malloc(sizeof(uint8_t) * size);
-    for (size_t i = 0; i < size; ++i) {
-        buf[i] = rand();
+    if (strcmp(section, current) != 0) {
+        strncpy(current, section, sizeof(current) - 1);
+        width = 0;
+        height = 0;
+    }
+
+    if (strcmp(name, "width") == 0) {
+        width = strtol(value, NULL, 10);
+    } else if (strcmp(name, "height") == 0) {
+        height = strtol(value, NULL, 10);
     }
 
-    double start = get_time();
-    for (size_t i = 0; i < BENCH_COUNT; ++i) {
-        uint32_t *dest = malloc(sizeof(uint32_t) * WIDTH * HEIGHT / SCALE);
-        quick_debayer_bggr8(buf, (uint8_t *)dest, WIDTH, HEIGHT, SCALE, BLACKLEVEL);
+    if (width > 0 && height > 0) {
+        add_resolution(width, height);
+        width = 0;
+        height = 0;
+    }
+    return 1;
+}
+
+static void load_config(const char *path)
+{
+    if (ini_parse(path, config_ini_handler, NULL) != 0) {
+        fprintf(stderr, "Could not parse %s\n", path);
+    }
+}
+
+static double get_time_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+struct timing {
+    double median_ns;
+    double p95_ns;
+};
+
+// Nearest rank percentiles of sorted samples
+static struct timing get_timing(double *samples)
+{
+    qsort(samples, iterations, sizeof(double), compare_doubles);
+    struct timing timing = {
+        .median_ns = samples[iterations / 2],
+        .p95_ns = samples[(iterations * 95 + 99) / 100 - 1],
+    };
+    return timing;
+}
+
+struct run {
+    MPPixelFormat format;
+    const uint8_t *source;
+    uint8_t *destination;
+    QuickDebayerParams params;
+    QuickDebayerPool *pool;
+};
+
+static void do_run(const struct run *run)
+{
+    if (run->pool) {
+        quick_debayer_parallel(run->pool, run->format, run->source, run->destination, &run->params);
+    } else {
+        quick_debayer(run->format, run->source, run->destination, &run->params);
+    }
+}
+
+// Warm the caches and branch predictors up first, then time every run on its
+// own so outliers don't hide in an average
+static struct timing time_runs(const struct run *run)
+{
+    for (int i = 0; i < warmup; ++i) {
+        do_run(run);
+    }
+
+    double *samples = malloc(sizeof(double) * iterations);
+    for (int i = 0; i < iterations; ++i) {
+        double start = get_time_ns();
+        do_run(run);
+        samples[i] = get_time_ns() - start;
+    }
+
+    struct timing timing = get_timing(samples);
+    free(samples);
+    return timing;
+}
+
+// Per source pixel and source byte, so every skip and output size of a mode
+// compares directly
+static void print_timing(const struct timing *timing, MPPixelFormat format, int width, int height)
+{
+    double pixels = (double)width * height;
+    double bytes = (double)mp_pixel_format_width_to_bytes(format, width) * height;
+    printf("\"median_ms\": %.4f, \"p95_ms\": %.4f, \"ns_per_pixel\": %.4f, \"mb_per_s\": %.1f",
+           timing->median_ns / 1e6,
+           timing->p95_ns / 1e6,
+           timing->median_ns / pixels,
+           bytes / timing->median_ns * 1e3);
+}
+
+static size_t get_dest_size(const QuickDebayerParams *params)
+{
+    int width, height;
+    quick_debayer_get_size(params, &width, &height);
+    return (size_t)width * height * 4;
+}
+
+// Every resolution, skip, format, mode, output and lut with every
+// implementation, each checked against the C one
+static void bench_kernels(const uint8_t *source, const QuickDebayerLut *luts)
+{
+    bool first = true;
+    printf("  \"kernels\": [\n");
+
+    for (int res = 0; res < num_resolutions; ++res) {
+        // Skip 0 samples the frame at the usual preview size instead
+        for (int skip = 0; skip <= MAX_SKIP; ++skip) {
+            for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+                for (QuickDebayerMode mode = 0; mode < QUICK_DEBAYER_MODE_MAX; ++mode) {
+                    for (int l = 0; l < NUM_LUTS * QUICK_DEBAYER_OUTPUT_MAX; ++l) {
+                        QuickDebayerOutput output = l % QUICK_DEBAYER_OUTPUT_MAX;
+                        int lut = l / QUICK_DEBAYER_OUTPUT_MAX;
+                        struct run run = {
+                            .format = formats[f],
+                            .source = source,
+                            .params = {
+                                .width = resolutions[res].width,
+                                .height = resolutions[res].height,
+                                .skip = skip,
+                                .dest_width = skip ? 0 : SCALED_WIDTH,
+                                .dest_height = skip ? 0 : SCALED_HEIGHT,
+                                .mode = mode,
+                                .lut = &luts[lut],
+                                .output = output,
+                            },
+                        };
+
+                        size_t size = get_dest_size(&run.params);
+                        uint8_t *reference = calloc(1, size);
+                        quick_debayer_set_impl(QUICK_DEBAYER_IMPL_C);
+                        quick_debayer(run.format, source, reference, &run.params);
+                        run.destination = malloc(size);
+
+                        for (QuickDebayerImpl impl = QUICK_DEBAYER_IMPL_C; impl < QUICK_DEBAYER_IMPL_MAX; ++impl) {
+                            if (!quick_debayer_set_impl(impl)) {
+                                continue;
+                            }
+
+                            memset(run.destination, 0, size);
+                            do_run(&run);
+                            bool matches = memcmp(run.destination, reference, size) == 0;
+                            if (!matches) {
+                                fprintf(stderr, "%s %dx%d skip %d %s %s %s %s: output differs from c\n",
+                                        quick_debayer_impl_name(impl),
+                                        run.params.width, run.params.height, skip,
+                                        mp_pixel_format_to_str(run.format),
+                                        quick_debayer_mode_name(mode),
+                                        output_names[output],
+                                        lut_names[lut]);
+                            }
+
+                            struct timing timing = time_runs(&run);
+
+                            printf("%s    { \"width\": %d, \"height\": %d, \"skip\": %d, \"format\": \"%s\", \"mode\": \"%s\", \"output\": \"%s\", \"lut\": \"%s\", \"impl\": \"%s\", \"matches_c\": %s, ",
+                                   first ? "" : ",\n",
+                                   run.params.width, run.params.height, skip,
+                                   mp_pixel_format_to_str(run.format),
+                                   quick_debayer_mode_name(mode),
+                                   output_names[output],
+                                   lut_names[lut],
+                                   quick_debayer_impl_name(impl),
+                                   matches ? "true" : "false");
+                            print_timing(&timing, run.format, run.params.width, run.params.height);
+                            printf(" }");
+                            first = false;
+                        }
+
+                        free(run.destination);
+                        free(reference);
+                    }
+                }
+            }
+        }
+    }
+
+    quick_debayer_set_impl(QUICK_DEBAYER_IMPL_AUTO);
+    printf("\n  ],\n");
+}
+
+// Splitting the frame over more threads, the output has to stay the same
+static void bench_threads(const uint8_t *source, const QuickDebayerLut *lut)
+{
+    struct run run = {
+        .format = MP_PIXEL_FMT_BGGR8,
+        .source = source,
+        .params = {
+            .width = resolutions[0].width,
+            .height = resolutions[0].height,
+            .skip = 2,
+            .lut = lut,
+        },
+    };
+
+    size_t size = get_dest_size(&run.params);
+    uint8_t *reference = calloc(1, size);
+    quick_debayer(run.format, source, reference, &run.params);
+    run.destination = malloc(size);
+
+    printf("  \"threads\": [\n");
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int threads = 1; threads <= cpus; threads *= 2) {
+        run.pool = quick_debayer_pool_new(threads);
+
+        memset(run.destination, 0, size);
+        do_run(&run);
+        bool matches = memcmp(run.destination, reference, size) == 0;
+        struct timing timing = time_runs(&run);
+
+        printf("%s    { \"threads\": %d, \"width\": %d, \"height\": %d, \"skip\": %d, \"format\": \"%s\", \"matches_single\": %s, ",
+               threads == 1 ? "" : ",\n",
+               quick_debayer_pool_get_threads(run.pool),
+               run.params.width, run.params.height, run.params.skip,
+               mp_pixel_format_to_str(run.format),
+               matches ? "true" : "false");
+        print_timing(&timing, run.format, run.params.width, run.params.height);
+        printf(" }");
+
+        quick_debayer_pool_free(run.pool);
+    }
+    printf("\n  ],\n");
+
+    free(run.destination);
+    free(reference);
+}
+
+// Rotating while debayering against debayering and then rotating the pixbuf
+// like the preview used to
+static void bench_rotation(const uint8_t *source, const QuickDebayerLut *lut)
+{
+    QuickDebayerParams params = {
+        .width = resolutions[0].width,
+        .height = resolutions[0].height,
+        .skip = 2,
+        .lut = lut,
+    };
+    int out_width, out_height;
+    quick_debayer_get_size(&params, &out_width, &out_height);
+
+    double *two_pass = malloc(sizeof(double) * iterations);
+    double *fused = malloc(sizeof(double) * iterations);
+
+    printf("  \"rotation\": [\n");
+    for (int rotation = 90; rotation < 360; rotation += 90) {
+        int width = rotation == 180 ? out_width : out_height;
+        int height = rotation == 180 ? out_height : out_width;
+
+        GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, out_width, out_height);
+        GdkPixbuf *fused_pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+        GdkPixbuf *rotated = NULL;
+
+        for (int i = -warmup; i < iterations; ++i) {
+            if (rotated) {
+                g_object_unref(rotated);
+            }
+
+            double start = get_time_ns();
+            params.rotation = 0;
+            params.stride = gdk_pixbuf_get_rowstride(pixbuf);
+            quick_debayer_bggr8(source, gdk_pixbuf_get_pixels(pixbuf), &params);
+            rotated = gdk_pixbuf_rotate_simple(pixbuf, (GdkPixbufRotation)rotation);
+            double middle = get_time_ns();
+            params.rotation = rotation;
+            params.stride = gdk_pixbuf_get_rowstride(fused_pixbuf);
+            quick_debayer_bggr8(source, gdk_pixbuf_get_pixels(fused_pixbuf), &params);
+            double end = get_time_ns();
+
+            if (i >= 0) {
+                two_pass[i] = middle - start;
+                fused[i] = end - middle;
+            }
+        }
+
+        // Both have to give the same image
+        bool matches = true;
+        for (int row = 0; row < height; ++row) {
+            const guchar *a = gdk_pixbuf_get_pixels(fused_pixbuf) + row * gdk_pixbuf_get_rowstride(fused_pixbuf);
+            const guchar *b = gdk_pixbuf_get_pixels(rotated) + row * gdk_pixbuf_get_rowstride(rotated);
+            if (memcmp(a, b, width * 3) != 0) {
+                matches = false;
+                break;
+            }
+        }
+
+        struct timing two_pass_timing = get_timing(two_pass);
+        struct timing fused_timing = get_timing(fused);
+        printf("%s    { \"rotation\": %d, \"two_pass_median_ms\": %.4f, \"two_pass_p95_ms\": %.4f, \"fused_median_ms\": %.4f, \"fused_p95_ms\": %.4f, \"matches_two_pass\": %s }",
+               rotation == 90 ? "" : ",\n",
+               rotation,
+               two_pass_timing.median_ns / 1e6,
+               two_pass_timing.p95_ns / 1e6,
+               fused_timing.median_ns / 1e6,
+               fused_timing.p95_ns / 1e6,
+               matches ? "true" : "false");
+
+        g_object_unref(rotated);
+        g_object_unref(fused_pixbuf);
+        g_object_unref(pixbuf);
+    }
+    printf("\n  ],\n");
+
+    free(fused);
+    free(two_pass);
+}
+
+// Noise free test scene: a colour gradient with a zone plate that goes up to
+// the sensor's nyquist frequency, so aliasing in the preview shows up as error
+static double scene(const struct resolution *res, int x, int y, int channel)
+{
+    double u = x / (double)res->width;
+    double v = y / (double)res->height;
+    double dx = x - res->width / 2.0;
+    double dy = y - res->height / 2.0;
+    double zone = 0.5 + 0.5 * cos(M_PI * (dx * dx + dy * dy) / (res->width * 1.5));
+    double gradient[3] = { u, 1.0 - u, v };
+    return 255.0 * (0.5 * gradient[channel] + 0.4 * zone + 0.05);
+}
+
+static double srgb(double linear)
+{
+    linear = linear < 0.0 ? 0.0 : (linear > 1.0 ? 1.0 : linear);
+    return linear <= 0.0031308 ? 12.92 * linear : 1.055 * pow(linear, 1.0 / 2.4) - 0.055;
+}
+
+// The scene averaged over every output pixel's block and mapped to sRGB
+static double *scene_reference(const struct resolution *res, int skip)
+{
+    int step = 2 * skip;
+    int out_width = res->width / step;
+    int out_height = res->height / step;
+    double *expected = malloc(sizeof(double) * out_width * out_height * 3);
+    for (int y = 0; y < out_height; ++y) {
+        for (int x = 0; x < out_width; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                double sum = 0;
+                for (int j = 0; j < step; ++j) {
+                    for (int i = 0; i < step; ++i) {
+                        sum += scene(res, x * step + i, y * step + j, c);
+                    }
+                }
+                expected[(y * out_width + x) * 3 + c] = 255.0 * srgb(sum / (step * step) / 255.0);
+            }
+        }
+    }
+    return expected;
+}
+
+static double psnr(const uint8_t *preview, const double *expected, size_t count)
+{
+    double error = 0;
+    for (size_t i = 0; i < count; ++i) {
+        double diff = preview[i] - expected[i];
+        error += diff * diff;
+    }
+    error /= count;
+    return 10.0 * log10(255.0 * 255.0 / error);
+}
+
+// Image quality of both modes, on a mosaiced scene with a bit of noise
+static void bench_psnr()
+{
+    const struct resolution *res = &resolutions[0];
+    uint8_t *mosaic = malloc((size_t)res->width * res->height);
+    for (int y = 0; y < res->height; ++y) {
+        for (int x = 0; x < res->width; ++x) {
+            // B G
+            // G R
+            int channel = 2 - (x % 2) - (y % 2);
+            double noise = (rand() % 9) - 4;
+            double value = scene(res, x, y, channel) + noise + BLACKLEVEL;
+            mosaic[y * res->width + x] = value < 0 ? 0 : (value > 255 ? 255 : value);
+        }
+    }
+
+    QuickDebayerParams params = {
+        .width = res->width,
+        .height = res->height,
+    };
+
+    printf("  \"psnr\": [\n");
+    for (int skip = 1; skip <= 3; ++skip) {
+        params.skip = skip;
+        int out_width, out_height;
+        quick_debayer_get_size(&params, &out_width, &out_height);
+        size_t count = (size_t)out_width * out_height * 3;
+        double *expected = scene_reference(res, skip);
+        uint8_t *dest = malloc(count);
+
+        for (QuickDebayerMode mode = 0; mode < QUICK_DEBAYER_MODE_MAX; ++mode) {
+            params.mode = mode;
+            quick_debayer_bggr8(mosaic, dest, &params);
+            printf("%s    { \"width\": %d, \"height\": %d, \"skip\": %d, \"mode\": \"%s\", \"psnr_db\": %.2f }",
+                   skip == 1 && mode == 0 ? "" : ",\n",
+                   res->width, res->height, skip,
+                   quick_debayer_mode_name(mode),
+                   psnr(dest, expected, count));
+        }
+
         free(dest);
+        free(expected);
+    }
+    printf("\n  ]\n");
+
+    free(mosaic);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-i iterations] [-w warmup runs] [config.ini ...]\n", name);
+    fprintf(stderr, "Benchmarks the resolutions of the given configs, or of config/*.ini\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "i:w:")) != -1) {
+        switch (opt) {
+            case 'i':
+                iterations = strtol(optarg, NULL, 10);
+                break;
+            case 'w':
+                warmup = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (iterations < 1 || warmup < 0) {
+        usage(argv[0]);
+    }
+
+    if (optind < argc) {
+        for (int i = optind; i < argc; ++i) {
+            load_config(argv[i]);
+        }
+    } else {
+        glob_t configs;
+        if (glob("config/*.ini", 0, NULL, &configs) == 0) {
+            for (size_t i = 0; i < configs.gl_pathc; ++i) {
+                load_config(configs.gl_pathv[i]);
+            }
+            globfree(&configs);
+        }
+    }
+    if (num_resolutions == 0) {
+        for (size_t i = 0; i < sizeof(default_resolutions) / sizeof(default_resolutions[0]); ++i) {
+            add_resolution(default_resolutions[i].width, default_resolutions[i].height);
+        }
+    }
+
+    // Large enough for the largest resolution in any format
+    size_t size = 0;
+    for (int i = 0; i < num_resolutions; ++i) {
+        size_t frame = (size_t)resolutions[i].width * resolutions[i].height * 2;
+        size = frame > size ? frame : size;
     }
-    double end = get_time();
-    printf("Benchmark took %fms per run\n", (end - start) / BENCH_COUNT * 1000);
 
-    free(buf);
+    srand(time(NULL));
+    uint8_t *source = malloc(size);
+    for (size_t i = 0; i < size; ++i) {
+        source[i] = rand();
+    }
+
+    // Some mixing of every channel, with negative coefficients like real
+    // forward matrices have
+    static const float matrix[] = {
+        1.7, -0.5, -0.2,
+        -0.3, 1.5, -0.2,
+        0.0, -0.6, 1.6,
+    };
+    QuickDebayerLut luts[NUM_LUTS];
+    quick_debayer_lut_init(&luts[0], BLACKLEVEL, 255, NULL);
+    quick_debayer_lut_init_matrix(&luts[1], BLACKLEVEL, 255, NULL, matrix);
+    const QuickDebayerLut *lut = &luts[0];
+
+    printf("{\n");
+    printf("  \"impl\": \"%s\",\n", quick_debayer_impl_name(quick_debayer_get_impl()));
+    printf("  \"iterations\": %d,\n", iterations);
+    printf("  \"warmup\": %d,\n", warmup);
+
+    bench_kernels(source, luts);
+    bench_threads(source, lut);
+    bench_rotation(source, lut);
+    bench_psnr();
+
+    printf("}\n");
+
+    free(source);
+    return 0;
 }
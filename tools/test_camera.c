@@ -16,7 +16,7 @@ double get_time()
 
 void on_capture(MPImage image, void *user_data)
 {
-    size_t num_bytes = mp_pixel_format_bytes_per_pixel(image.pixel_format) * image.width * image.height;
+    size_t num_bytes = mp_pixel_format_width_to_bytes(image.pixel_format, image.width) * image.height;
     uint8_t *data = malloc(num_bytes);
     memcpy(data, image.data, num_bytes);
 
@@ -51,6 +51,9 @@ int main(int argc, char *argv[])
 
     printf("Finding the device took %fms\n", (find_end - find_start) * 1000);
 
+    // Names the sensor for the mode cache
+    const char *entity_name;
+
     int video_fd;
     uint32_t video_entity_id;
     {
@@ -61,6 +64,7 @@ int main(int argc, char *argv[])
         }
 
         video_entity_id = entity->id;
+        entity_name = entity->name;
 
         const struct media_v2_interface *iface = mp_device_find_entity_interface(device, video_entity_id);
 
@@ -85,6 +89,7 @@ int main(int argc, char *argv[])
             printf("Unable to find sub-device\n");
             return 1;
         }
+        entity_name = entity->name;
 
         const struct media_v2_pad *source_pad = mp_device_get_pad_from_entity(device, entity->id);
         const struct media_v2_pad *sink_pad = mp_device_get_pad_from_entity(device, video_entity_id);
@@ -126,6 +131,16 @@ int main(int argc, char *argv[])
 
     double list_end = get_time();
 
+    // Once to fill the cache if needed, then from it
+    const char *model = mp_device_get_info(device)->model;
+    mp_camera_mode_list_free(mp_camera_list_available_modes_cached(camera, model, entity_name));
+
+    double cached_start = get_time();
+    mp_camera_mode_list_free(mp_camera_list_available_modes_cached(camera, model, entity_name));
+    double cached_end = get_time();
+
+    printf("Listing the modes from the cache took %fms\n", (cached_end - cached_start) * 1000);
+
     printf("Available modes: (took %fms)\n", (list_end - open_end) * 1000);
     for (MPCameraModeList *mode = modes; mode; mode = mp_camera_mode_list_next(mode)) {
         MPCameraMode *m = mp_camera_mode_list_get(mode);
@@ -139,7 +154,7 @@ int main(int argc, char *argv[])
         double start_capture = get_time();
 
         mp_camera_set_mode(camera, m);
-        mp_camera_start_capture(camera);
+        mp_camera_start_capture(camera, 4);
 
         double last = get_time();
         printf("    Testing 10 captures, starting took %fms\n", (last - start_capture) * 1000);
@@ -0,0 +1,174 @@
+#include "trace.h"
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Per thread, the oldest events are overwritten
+#define TRACE_EVENTS 16384
+
+static const char *trace_point_names[MP_TRACE_MAX] = {
+    "dqbuf",
+    "copy",
+    "debayer",
+    "handoff",
+    "update_preview",
+    "preview_draw",
+    "burst_write",
+    "camera_switch",
+};
+
+struct trace_event {
+    // Index of the event in its ring, written last so the dump can tell
+    // events that were overwritten while it read them
+    atomic_uint_least64_t index;
+    uint32_t point;
+    uint32_t sequence;
+    uint64_t start;
+    uint64_t end;
+};
+
+// Only written by its own thread
+struct trace_ring {
+    pid_t tid;
+    atomic_uint_least64_t head;
+    struct trace_ring *next;
+    struct trace_event events[TRACE_EVENTS];
+};
+
+bool mp_trace_enabled = false;
+
+static const char *trace_path = NULL;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *rings = NULL;
+static _Thread_local struct trace_ring *thread_ring = NULL;
+
+uint64_t mp_trace_now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static struct trace_ring *get_ring()
+{
+    if (!thread_ring) {
+        thread_ring = calloc(1, sizeof(struct trace_ring));
+        thread_ring->tid = syscall(SYS_gettid);
+        atomic_init(&thread_ring->head, 0);
+        for (int i = 0; i < TRACE_EVENTS; ++i) {
+            atomic_init(&thread_ring->events[i].index, UINT64_MAX);
+        }
+
+        pthread_mutex_lock(&rings_lock);
+        thread_ring->next = rings;
+        rings = thread_ring;
+        pthread_mutex_unlock(&rings_lock);
+    }
+    return thread_ring;
+}
+
+void mp_trace_record(MPTracePoint point, uint32_t sequence, uint64_t start, uint64_t end)
+{
+    struct trace_ring *ring = get_ring();
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct trace_event *event = &ring->events[head % TRACE_EVENTS];
+
+    // Mark the slot as being written first
+    atomic_store_explicit(&event->index, UINT64_MAX, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    event->point = point;
+    event->sequence = sequence;
+    event->start = start;
+    event->end = end;
+    atomic_store_explicit(&event->index, head, memory_order_release);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static gboolean on_dump_signal(gpointer data)
+{
+    mp_trace_dump();
+    return G_SOURCE_CONTINUE;
+}
+
+void mp_trace_init()
+{
+    trace_path = getenv("MEGAPIXELS_TRACE");
+    if (!trace_path || !trace_path[0]) {
+        return;
+    }
+
+    mp_trace_enabled = true;
+    g_unix_signal_add(SIGUSR1, on_dump_signal, NULL);
+    g_print("Tracing, send SIGUSR1 to write the trace to %s\n", trace_path);
+}
+
+bool mp_trace_dump()
+{
+    if (!mp_trace_enabled) {
+        return false;
+    }
+
+    FILE *file = fopen(trace_path, "w");
+    if (!file) {
+        g_printerr("Could not open %s\n", trace_path);
+        return false;
+    }
+
+    fprintf(file, "{\"traceEvents\":[\n");
+
+    pid_t pid = getpid();
+    bool first = true;
+
+    pthread_mutex_lock(&rings_lock);
+    for (struct trace_ring *ring = rings; ring; ring = ring->next) {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t tail = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+
+        for (uint64_t i = tail; i < head; ++i) {
+            struct trace_event *slot = &ring->events[i % TRACE_EVENTS];
+            if (atomic_load_explicit(&slot->index, memory_order_acquire) != i) {
+                continue;
+            }
+            uint32_t point = slot->point;
+            uint32_t sequence = slot->sequence;
+            uint64_t start = slot->start;
+            uint64_t end = slot->end;
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&slot->index, memory_order_relaxed) != i) {
+                continue;
+            }
+
+            if (start == end) {
+                fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"sequence\":%" PRIu32 "}}",
+                        first ? "" : ",\n",
+                        trace_point_names[point], start / 1000.0,
+                        pid, ring->tid, sequence);
+            } else {
+                fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"sequence\":%" PRIu32 "}}",
+                        first ? "" : ",\n",
+                        trace_point_names[point], start / 1000.0, (end - start) / 1000.0,
+                        pid, ring->tid, sequence);
+            }
+            first = false;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    g_print("Wrote trace to %s\n", trace_path);
+    return true;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Where the time of a frame goes, from the sensor to the screen. Every event
+// is keyed by the V4L2 sequence number of its frame.
+typedef enum {
+    // From the sensor timestamp until the buffer was dequeued
+    MP_TRACE_DQBUF,
+    // Copying the frame out of the camera buffer
+    MP_TRACE_COPY,
+    // Debayering the preview, rotation is done in the same pass
+    MP_TRACE_DEBAYER,
+    // The preview is posted to the GTK thread
+    MP_TRACE_HANDOFF,
+    MP_TRACE_UPDATE_PREVIEW,
+    MP_TRACE_PREVIEW_DRAW,
+    MP_TRACE_BURST_WRITE,
+    // From starting to switch the camera until its first frame, keyed by
+    // that frame
+    MP_TRACE_CAMERA_SWITCH,
+
+    MP_TRACE_MAX,
+} MPTracePoint;
+
+extern bool mp_trace_enabled;
+
+// Enables tracing when MEGAPIXELS_TRACE is set to the file to write the
+// Chrome trace event JSON to. It's written on SIGUSR1 and mp_trace_dump.
+void mp_trace_init();
+bool mp_trace_dump();
+
+// CLOCK_MONOTONIC in nanoseconds, the clock of the V4L2 timestamps
+uint64_t mp_trace_now();
+void mp_trace_record(MPTracePoint point, uint32_t sequence, uint64_t start, uint64_t end);
+
+// Disabled trace points only cost a single branch
+static inline uint64_t mp_trace_begin()
+{
+    if (__builtin_expect(mp_trace_enabled, false)) {
+        return mp_trace_now();
+    }
+    return 0;
+}
+
+static inline void mp_trace_end(MPTracePoint point, uint32_t sequence, uint64_t start)
+{
+    if (__builtin_expect(mp_trace_enabled, false)) {
+        mp_trace_record(point, sequence, start, mp_trace_now());
+    }
+}
+
+static inline void mp_trace_instant(MPTracePoint point, uint32_t sequence)
+{
+    if (__builtin_expect(mp_trace_enabled, false)) {
+        uint64_t now = mp_trace_now();
+        mp_trace_record(point, sequence, now, now);
+    }
+}